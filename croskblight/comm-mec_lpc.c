@@ -3,20 +3,20 @@
 static ULONG CrosKBLightDebugLevel = 100;
 static ULONG CrosKBLightDebugCatagories = DBG_INIT || DBG_PNP || DBG_IOCTL;
 
-/* Version of mailbox interface */
-#define EC_MAILBOX_VERSION		0
-
 /* Command to start mailbox transaction */
 #define EC_MAILBOX_START_COMMAND	0xda
 
-/* Version of EC protocol */
-#define EC_MAILBOX_PROTO_VERSION	3
-
 /* Number of header bytes to be counted as data bytes */
 #define EC_MAILBOX_DATA_EXTRA		2
 
-/* Maximum timeout */
-#define EC_MAILBOX_TIMEOUT		1
+/* Maximum timeout, in 100ns units */
+#define EC_MAILBOX_TIMEOUT		(10 * 1000 * 1000)
+
+/* Maximum timeout for WILCO_EC_FLAG_BOUNDED commands, in 100ns units */
+#define EC_MAILBOX_BOUNDED_TIMEOUT	(20 * 1000 * 10)
+
+/* Status poll interval, in 100ns units */
+#define EC_MAILBOX_POLL_INTERVAL	(10 * 100)
 
 /* EC response flags */
 #define EC_CMDR_DATA		BIT(0)	/* Data ready for host to read */
@@ -25,22 +25,117 @@ static ULONG CrosKBLightDebugCatagories = DBG_INIT || DBG_PNP || DBG_IOCTL;
 #define EC_CMDR_CMD		BIT(3)	/* Last host write was a command */
 
 
-static __inline void outb(unsigned char __val, unsigned int __port) {
+/*
+ * Build with CROSKBLIGHT_PORT_TRACE defined to record every port access into
+ * ec_port_trace, a ring of struct ec_port_trace_record that can be dumped
+ * from the debugger and replayed offline with the original timing.
+ */
+#ifdef CROSKBLIGHT_PORT_TRACE
+#define EC_PORT_TRACE_ENTRIES	4096	/* Must be a power of 2 */
+
+struct ec_port_trace_record ec_port_trace[EC_PORT_TRACE_ENTRIES];
+volatile LONG ec_port_trace_next = -1;
+LARGE_INTEGER ec_port_trace_start, ec_port_trace_freq;
+
+static void ec_port_trace_add(enum ec_port_trace_op op, unsigned int port, unsigned short value) {
+	LONG idx = InterlockedIncrement(&ec_port_trace_next);
+	LARGE_INTEGER now = KeQueryPerformanceCounter(NULL);
+	struct ec_port_trace_record* rec = &ec_port_trace[idx & (EC_PORT_TRACE_ENTRIES - 1)];
+
+	rec->time_us = (UINT64)(((now.QuadPart - ec_port_trace_start.QuadPart) * 1000 * 1000) /
+		ec_port_trace_freq.QuadPart);
+	rec->port = (UINT16)port;
+	rec->value = value;
+	rec->op = (UINT8)op;
+}
+#else
+#define ec_port_trace_add(op, port, value)
+#endif
+
+/*
+ * The port helpers count into the ecPortOps of the device that owns the
+ * transaction; that device's ecLock is held for the whole of it.
+ */
+
+static __inline void outb(PCROSKBLIGHT_PORT_STATS __ops, unsigned char __val, unsigned int __port) {
 	WRITE_PORT_UCHAR((PUCHAR)__port, __val);
+	__ops->Writes++;
+	ec_port_trace_add(EC_TRACE_OUTB, __port, __val);
 }
 
-static __inline void outw(unsigned short __val, unsigned int __port) {
+static __inline void outw(PCROSKBLIGHT_PORT_STATS __ops, unsigned short __val, unsigned int __port) {
 	WRITE_PORT_USHORT((PUSHORT)__port, __val);
+	__ops->Writes++;
+	ec_port_trace_add(EC_TRACE_OUTW, __port, __val);
 }
 
-static __inline unsigned char inb(unsigned int __port) {
-	return READ_PORT_UCHAR((PUCHAR)__port);
+static __inline unsigned char inb(PCROSKBLIGHT_PORT_STATS __ops, unsigned int __port) {
+	unsigned char __val = READ_PORT_UCHAR((PUCHAR)__port);
+	__ops->Reads++;
+	ec_port_trace_add(EC_TRACE_INB, __port, __val);
+	return __val;
 }
 
-static __inline unsigned short inw(unsigned int __port) {
-	return READ_PORT_USHORT((PUSHORT)__port);
+static __inline unsigned short inw(PCROSKBLIGHT_PORT_STATS __ops, unsigned int __port) {
+	unsigned short __val = READ_PORT_USHORT((PUSHORT)__port);
+	__ops->Reads++;
+	ec_port_trace_add(EC_TRACE_INW, __port, __val);
+	return __val;
 }
 
+/*
+ * Build with CROSKBLIGHT_FAULT_INJECTION defined to make the mailbox misbehave
+ * on demand. Set ec_fault_type from the debugger, then either
+ * ec_fault_index to hit one exact transaction (counted from 1) or
+ * ec_fault_percent to hit transactions at random.
+ */
+#ifdef CROSKBLIGHT_FAULT_INJECTION
+enum ec_fault {
+	EC_FAULT_NONE,
+	EC_FAULT_LATENCY,	/* Add EC_FAULT_LATENCY_MS before the response */
+	EC_FAULT_BUSY,		/* Status poll sees EC_CMDR_BUSY until the timeout */
+	EC_FAULT_FLAG,		/* Nonzero result flag on the data port */
+	EC_FAULT_CHECKSUM,	/* Corrupted response checksum */
+	EC_FAULT_SHORT,		/* Response data_size one byte short */
+	EC_FAULT_KBBL_STATUS,	/* KBBL status byte reports 0xFF */
+	EC_FAULT_DROP_POSTED,	/* NO_RESPONSE command never started */
+};
+
+#define EC_FAULT_LATENCY_MS	50
+
+enum ec_fault ec_fault_type = EC_FAULT_NONE;
+ULONG ec_fault_index = 0;
+ULONG ec_fault_percent = 0;
+ULONG ec_fault_transactions = 0;
+ULONG ec_faults_injected = 0;
+static ULONG ec_fault_seed = 0x5eed;
+static BOOLEAN ec_fault_busy;
+
+/* While EC_FAULT_BUSY is in force every status read reports a busy EC. */
+#define ec_fault_status(status) \
+	((UINT8)((status) | (ec_fault_busy ? EC_CMDR_BUSY : 0)))
+
+static BOOLEAN ec_fault_hit(enum ec_fault fault, BOOLEAN armed) {
+	if (!armed || ec_fault_type != fault)
+		return FALSE;
+	ec_faults_injected++;
+	return TRUE;
+}
+
+/* Decide once per transaction whether the configured fault fires. */
+static BOOLEAN ec_fault_arm(void) {
+	ec_fault_transactions++;
+	if (ec_fault_type == EC_FAULT_NONE)
+		return FALSE;
+	if (ec_fault_index)
+		return ec_fault_transactions == ec_fault_index;
+	return (RtlRandomEx(&ec_fault_seed) % 100) < ec_fault_percent;
+}
+#else
+#define ec_fault_hit(fault, armed) FALSE
+#define ec_fault_status(status) (status)
+#endif
+
 FAST_MUTEX MecAccessMutex;
 
 int wait_for_ec(int status_addr, int timeout_usec);
@@ -75,11 +170,12 @@ enum cros_ec_lpc_mec_emi_access_mode {
 
 UINT16 mec_emi_base = 0, mec_emi_end = 0;
 
-static void ec_mec_emi_write_access(UINT16 address, enum cros_ec_lpc_mec_emi_access_mode access_type) {
-	outw((address & 0xFFFC) | (UINT16)access_type, MEC_EMI_EC_ADDRESS_B0(mec_emi_base));
+static void ec_mec_emi_write_access(PCROSKBLIGHT_PORT_STATS ops, UINT16 address, enum cros_ec_lpc_mec_emi_access_mode access_type) {
+	ops->AddressWrites++;
+	outw(ops, (address & 0xFFFC) | (UINT16)access_type, MEC_EMI_EC_ADDRESS_B0(mec_emi_base));
 }
 
-static int ec_mec_xfer(ec_xfer_direction direction, UINT16 address,
+static int ec_mec_xfer(PCROSKBLIGHT_PORT_STATS ops, ec_xfer_direction direction, UINT16 address,
 	UINT8* data, UINT16 size)
 {
 	if (mec_emi_base == 0 || mec_emi_end == 0)
@@ -94,29 +190,29 @@ static int ec_mec_xfer(ec_xfer_direction direction, UINT16 address,
 	int pos = 0;
 	UINT16 temp[2];
 	if (address % 4 > 0) {
-		ec_mec_emi_write_access(address, MEC_EC_BYTE_ACCESS);
+		ec_mec_emi_write_access(ops, address, MEC_EC_BYTE_ACCESS);
 		/* Unaligned start address */
 		for (int i = address % 4; i < 4; ++i) {
 			UINT8* storage = &data[pos++];
 			if (direction == EC_MEC_WRITE)
-				outb(*storage, MEC_EMI_EC_DATA_B0(mec_emi_base) + i);
+				outb(ops, *storage, MEC_EMI_EC_DATA_B0(mec_emi_base) + i);
 			else if (direction == EC_MEC_READ)
-				*storage = inb(MEC_EMI_EC_DATA_B0(mec_emi_base) + i);
+				*storage = inb(ops, MEC_EMI_EC_DATA_B0(mec_emi_base) + i);
 		}
 		address = (address + 4) & 0xFFFC;
 	}
 
 	if (size - pos >= 4) {
-		ec_mec_emi_write_access(address, MEC_EC_LONG_ACCESS_AUTOINCREMENT);
+		ec_mec_emi_write_access(ops, address, MEC_EC_LONG_ACCESS_AUTOINCREMENT);
 		while (size - pos >= 4) {
 			if (direction == EC_MEC_WRITE) {
 				memcpy(temp, &data[pos], sizeof(temp));
-				outw(temp[0], MEC_EMI_EC_DATA_B0(mec_emi_base));
-				outw(temp[1], MEC_EMI_EC_DATA_B2(mec_emi_base));
+				outw(ops, temp[0], MEC_EMI_EC_DATA_B0(mec_emi_base));
+				outw(ops, temp[1], MEC_EMI_EC_DATA_B2(mec_emi_base));
 			}
 			else if (direction == EC_MEC_READ) {
-				temp[0] = inw(MEC_EMI_EC_DATA_B0(mec_emi_base));
-				temp[1] = inw(MEC_EMI_EC_DATA_B2(mec_emi_base));
+				temp[0] = inw(ops, MEC_EMI_EC_DATA_B0(mec_emi_base));
+				temp[1] = inw(ops, MEC_EMI_EC_DATA_B2(mec_emi_base));
 				memcpy(&data[pos], temp, sizeof(temp));
 			}
 
@@ -126,13 +222,13 @@ static int ec_mec_xfer(ec_xfer_direction direction, UINT16 address,
 	}
 
 	if (size - pos > 0) {
-		ec_mec_emi_write_access(address, MEC_EC_BYTE_ACCESS);
+		ec_mec_emi_write_access(ops, address, MEC_EC_BYTE_ACCESS);
 		for (int i = 0; i < (size - pos); ++i) {
 			UINT8* storage = &data[pos + i];
 			if (direction == EC_MEC_WRITE)
-				outb(*storage, MEC_EMI_EC_DATA_B0(mec_emi_base) + i);
+				outb(ops, *storage, MEC_EMI_EC_DATA_B0(mec_emi_base) + i);
 			else if (direction == EC_MEC_READ)
-				*storage = inb(MEC_EMI_EC_DATA_B0(mec_emi_base) + i);
+				*storage = inb(ops, MEC_EMI_EC_DATA_B0(mec_emi_base) + i);
 		}
 	}
 
@@ -141,34 +237,105 @@ static int ec_mec_xfer(ec_xfer_direction direction, UINT16 address,
 	return 0;
 }
 
+EVT_WDF_INTERRUPT_ISR wilco_ec_isr;
+EVT_WDF_INTERRUPT_DPC wilco_ec_dpc;
+
 /**
- * wilco_ec_response_timed_out() - Wait for EC response.
+ * wilco_ec_isr() - EC completion interrupt.
+ * @Interrupt: Interrupt connected from the ConnectInterrupt setting.
+ * @MessageID: Unused.
+ *
+ * The line may be shared and isn't specific to the mailbox, so it is only
+ * claimed while a waiter is armed and the EC reports it is no longer busy.
+ * The status is read on every call, since that is what acknowledges the EC.
+ * Only edge-triggered lines are connected, so an unclaimed interrupt can't
+ * keep firing.
+ *
+ * Return: true if the interrupt completed a pending wait.
+ */
+BOOLEAN wilco_ec_isr(WDFINTERRUPT Interrupt, ULONG MessageID)
+{
+	PCROSKBLIGHT_CONTEXT pDevice = GetDeviceContext(WdfInterruptGetDevice(Interrupt));
+	UINT8 readByte;
+
+	UNREFERENCED_PARAMETER(MessageID);
+
+	/* Not counted in ecPortOps, which belongs to the waiting thread */
+	readByte = READ_PORT_UCHAR((PUCHAR)pDevice->ecIoCommand.Start.LowPart);
+	if (!pDevice->ecWaiting || (readByte & (EC_CMDR_PENDING | EC_CMDR_BUSY)))
+		return FALSE;
+
+	if (!InterlockedExchange(&pDevice->ecWaiting, 0))
+		return FALSE;
+
+	WdfInterruptQueueDpcForIsr(Interrupt);
+	return TRUE;
+}
+
+void wilco_ec_dpc(WDFINTERRUPT Interrupt, WDFOBJECT AssociatedObject)
+{
+	PCROSKBLIGHT_CONTEXT pDevice = GetDeviceContext(WdfInterruptGetDevice(Interrupt));
+
+	UNREFERENCED_PARAMETER(AssociatedObject);
+
+	InterlockedIncrement(&pDevice->ecInterrupts);
+	KeSetEvent(&pDevice->ecEvent, IO_NO_INCREMENT, FALSE);
+}
+
+/**
+ * wilco_ec_wait_response() - Wait for EC response.
  * @ec: EC device.
+ * @timeout: Maximum time to wait, in 100ns units.
+ * @request: Request whose cancellation ends the wait early, or NULL.
+ *
+ * The status port is polled every EC_MAILBOX_POLL_INTERVAL. With the
+ * completion interrupt connected the wait between polls is on ecEvent, so
+ * the interrupt only ends it early. The wait also ends once ecStopping is
+ * set; teardown signals ecEvent so that happens without delay.
  *
- * Return: true if EC timed out, false if EC did not time out.
+ * Return: STATUS_SUCCESS once the EC is idle, STATUS_IO_TIMEOUT, or
+ * STATUS_CANCELLED if the request was cancelled or the device is stopping.
  */
-static BOOLEAN wilco_ec_response_timed_out(PCROSKBLIGHT_CONTEXT pDevice)
+static NTSTATUS wilco_ec_wait_response(PCROSKBLIGHT_CONTEXT pDevice, LONGLONG timeout, WDFREQUEST request)
 {
 	LARGE_INTEGER CurrentTime;
 	KeQuerySystemTimePrecise(&CurrentTime);
 
 	LARGE_INTEGER Timeout;
-	Timeout.QuadPart = CurrentTime.QuadPart + (10 * 1000 * 1000);
+	Timeout.QuadPart = CurrentTime.QuadPart + timeout;
 
 	do {
-		UINT8 readByte = inb(pDevice->ecIoCommand.Start.LowPart);
+		/* Arm before polling so a completion in between still wakes us */
+		if (pDevice->ecInterrupt) {
+			KeClearEvent(&pDevice->ecEvent);
+			InterlockedExchange(&pDevice->ecWaiting, 1);
+		}
+
+		UINT8 readByte = ec_fault_status(inb(&pDevice->ecPortOps, pDevice->ecIoCommand.Start.LowPart));
+		pDevice->ecPortOps.StatusPolls++;
 		if (!(readByte &
-			(EC_CMDR_PENDING | EC_CMDR_BUSY)))
-			return FALSE;
+			(EC_CMDR_PENDING | EC_CMDR_BUSY))) {
+			InterlockedExchange(&pDevice->ecWaiting, 0);
+			return STATUS_SUCCESS;
+		}
+
+		if (pDevice->ecStopping || (request && WdfRequestIsCanceled(request))) {
+			InterlockedExchange(&pDevice->ecWaiting, 0);
+			return STATUS_CANCELLED;
+		}
 
 		LARGE_INTEGER Interval;
-		Interval.QuadPart = -10 * 100;
-		KeDelayExecutionThread(KernelMode, FALSE, &Interval);
+		Interval.QuadPart = -EC_MAILBOX_POLL_INTERVAL;
+		if (pDevice->ecInterrupt)
+			KeWaitForSingleObject(&pDevice->ecEvent, Executive, KernelMode, FALSE, &Interval);
+		else
+			KeDelayExecutionThread(KernelMode, FALSE, &Interval);
 
 		KeQuerySystemTimePrecise(&CurrentTime);
 	} while (CurrentTime.QuadPart < Timeout.QuadPart);
 
-	return TRUE;
+	InterlockedExchange(&pDevice->ecWaiting, 0);
+	return STATUS_IO_TIMEOUT;
 }
 
 /**
@@ -190,11 +357,71 @@ static UINT8 wilco_ec_checksum(const void* data, size_t size)
 	return checksum;
 }
 
-NTSTATUS wilco_ec_mailbox(PCROSKBLIGHT_CONTEXT pDevice, struct wilco_ec_message *msg) {
+/**
+ * wilco_ec_mailbox() - Send a message to the EC and read its response.
+ * @pDevice: Device context.
+ * @msg: Message to send.
+ * @portOps: Optional, receives the port operations the message used. The
+ *           device's own counters can't be read once ecLock is dropped.
+ *
+ * Return: Status of the exchange.
+ */
+NTSTATUS wilco_ec_mailbox(PCROSKBLIGHT_CONTEXT pDevice, struct wilco_ec_message *msg,
+	PCROSKBLIGHT_PORT_STATS portOps) {
 	NTSTATUS status = STATUS_SUCCESS;
 	struct wilco_ec_response* rs = pDevice->dataBuffer;
 	UINT8 checksum, flag;
-	WdfWaitLockAcquire(pDevice->ecLock, NULL);
+	size_t size;
+#ifdef CROSKBLIGHT_FAULT_INJECTION
+	BOOLEAN faultArmed;
+#endif
+	LONGLONG timeout;
+	LARGE_INTEGER lockTimeout;
+	LARGE_INTEGER lockStart, holdStart;
+
+	timeout = (msg->flags & WILCO_EC_FLAG_BOUNDED) ?
+		EC_MAILBOX_BOUNDED_TIMEOUT : EC_MAILBOX_TIMEOUT;
+
+	/* Bounded commands must not queue behind a slow transaction either */
+	lockTimeout.QuadPart = -timeout;
+	lockStart = KeQueryPerformanceCounter(NULL);
+	if (WdfWaitLockAcquire(pDevice->ecLock,
+		(msg->flags & WILCO_EC_FLAG_BOUNDED) ? &lockTimeout.QuadPart : NULL) == STATUS_TIMEOUT) {
+		CrosKBLightPrint(DEBUG_LEVEL_ERROR, DBG_IOCTL,
+			"EC busy with another command\n");
+		CrosKBLightRecordLatency(&pDevice->ecLockWaitStats, lockStart, STATUS_IO_TIMEOUT);
+		return STATUS_IO_TIMEOUT;
+	}
+	CrosKBLightRecordLatency(&pDevice->ecLockWaitStats, lockStart, STATUS_SUCCESS);
+	holdStart = KeQueryPerformanceCounter(NULL);
+	ec_port_trace_add(EC_TRACE_MAILBOX, 0, (unsigned short)msg->type);
+	RtlZeroMemory(&pDevice->ecPortOps, sizeof(pDevice->ecPortOps));
+
+	/* Teardown drains ecLock before freeing dataBuffer; don't start anew */
+	if (pDevice->ecStopping) {
+		status = STATUS_DEVICE_NOT_READY;
+		goto out;
+	}
+
+#ifdef CROSKBLIGHT_FAULT_INJECTION
+	faultArmed = ec_fault_arm();
+#endif
+
+	/*
+	 * A posted command may still be running on the EC. Let it finish before
+	 * overwriting the EMI window with the next request.
+	 */
+	if (pDevice->ecPosted) {
+		status = wilco_ec_wait_response(pDevice, timeout, msg->request);
+		if (status == STATUS_IO_TIMEOUT) {
+			CrosKBLightPrint(DEBUG_LEVEL_ERROR, DBG_IOCTL,
+				"posted command timed out\n");
+			pDevice->ecPosted = FALSE;
+		}
+		if (!NT_SUCCESS(status))
+			goto out;
+		pDevice->ecPosted = FALSE;
+	}
 
 	struct wilco_ec_request rq = { 0 };
 	rq.struct_version = EC_MAILBOX_PROTO_VERSION;
@@ -202,37 +429,63 @@ NTSTATUS wilco_ec_mailbox(PCROSKBLIGHT_CONTEXT pDevice, struct wilco_ec_message
 	rq.mailbox_version = EC_MAILBOX_VERSION;
 	rq.data_size = msg->request_size;
 
-	/* Checksum header and data */
-	rq.checksum = wilco_ec_checksum(&rq, sizeof(rq));
-	rq.checksum += wilco_ec_checksum(msg->request_data, msg->request_size);
-	rq.checksum = -rq.checksum;
+	/* Checksum header and data, unless the caller folded it already */
+	if (msg->flags & WILCO_EC_FLAG_CHECKSUM_VALID) {
+		rq.checksum = msg->request_checksum;
+	}
+	else {
+		rq.checksum = wilco_ec_checksum(&rq, sizeof(rq));
+		rq.checksum += wilco_ec_checksum(msg->request_data, msg->request_size);
+		rq.checksum = -rq.checksum;
+	}
 
 	//Start transfer
 
-	ec_mec_xfer(EC_MEC_WRITE, 0, &rq, sizeof(rq));
-	ec_mec_xfer(EC_MEC_WRITE, sizeof(rq), msg->request_data, msg->request_size);
+	ec_mec_xfer(&pDevice->ecPortOps, EC_MEC_WRITE, 0, &rq, sizeof(rq));
+	ec_mec_xfer(&pDevice->ecPortOps, EC_MEC_WRITE, sizeof(rq), msg->request_data, msg->request_size);
 
 	//Start the command
-	outb(EC_MAILBOX_START_COMMAND, pDevice->ecIoCommand.Start.LowPart);
+	if (!ec_fault_hit(EC_FAULT_DROP_POSTED, faultArmed && (msg->flags & WILCO_EC_FLAG_NO_RESPONSE)))
+		outb(&pDevice->ecPortOps, EC_MAILBOX_START_COMMAND, pDevice->ecIoCommand.Start.LowPart);
 
 	/* For some commands (eg shutdown) the EC will not respond, that's OK */
 	if (msg->flags & WILCO_EC_FLAG_NO_RESPONSE) {
 		CrosKBLightPrint(DEBUG_LEVEL_INFO, DBG_IOCTL,
 			"EC does not respond to this command\n");
+		pDevice->ecPosted = TRUE;
 		status = STATUS_SUCCESS;
 		goto out;
 	}
 
+#ifdef CROSKBLIGHT_FAULT_INJECTION
+	if (ec_fault_hit(EC_FAULT_LATENCY, faultArmed)) {
+		LARGE_INTEGER Interval;
+		Interval.QuadPart = -10 * 1000 * EC_FAULT_LATENCY_MS;
+		KeDelayExecutionThread(KernelMode, FALSE, &Interval);
+	}
+	ec_fault_busy = ec_fault_hit(EC_FAULT_BUSY, faultArmed);
+#endif
+
 	/* Wait for it to complete */
-	if (wilco_ec_response_timed_out(pDevice)) {
+	status = wilco_ec_wait_response(pDevice, timeout, msg->request);
+#ifdef CROSKBLIGHT_FAULT_INJECTION
+	ec_fault_busy = FALSE;
+#endif
+	if (status == STATUS_CANCELLED) {
+		/* The EC is still working on it, so the next command has to wait */
+		pDevice->ecPosted = TRUE;
+		goto out;
+	}
+	if (!NT_SUCCESS(status)) {
 		CrosKBLightPrint(DEBUG_LEVEL_ERROR, DBG_IOCTL,
 			"response timed out\n");
-		status = STATUS_IO_TIMEOUT;
 		goto out;
 	}
 
 	/* Check result */
-	flag = inb(pDevice->ecIoData.Start.LowPart);
+	flag = inb(&pDevice->ecPortOps, pDevice->ecIoData.Start.LowPart);
+	if (ec_fault_hit(EC_FAULT_FLAG, faultArmed))
+		flag = 0x01;
 	if (flag) {
 		CrosKBLightPrint(DEBUG_LEVEL_ERROR, DBG_IOCTL,
 			"bad response: 0x%02x\n", flag);
@@ -240,8 +493,28 @@ NTSTATUS wilco_ec_mailbox(PCROSKBLIGHT_CONTEXT pDevice, struct wilco_ec_message
 		goto out;
 	}
 
-	/* Read back response */
-	ec_mec_xfer(EC_MEC_READ, 0, rs, sizeof(*rs) + EC_MAILBOX_DATA_SIZE);
+	/*
+	 * Read back response. Header and data are contiguous and dword aligned
+	 * in the EMI window, so the whole packet streams out in a single
+	 * autoincrement burst sized for this command class.
+	 */
+	size = (msg->flags & WILCO_EC_FLAG_EXTENDED_DATA) ?
+		EC_MAILBOX_DATA_SIZE_EXTENDED : EC_MAILBOX_DATA_SIZE;
+	ec_mec_xfer(&pDevice->ecPortOps, EC_MEC_READ, 0, rs, (UINT16)(sizeof(*rs) + size));
+
+	if (ec_fault_hit(EC_FAULT_CHECKSUM, faultArmed))
+		rs->checksum ^= 0xFF;
+
+	checksum = wilco_ec_checksum(rs, sizeof(*rs) + size);
+	if (checksum) {
+		CrosKBLightPrint(DEBUG_LEVEL_ERROR, DBG_IOCTL,
+			"bad packet checksum 0x%02x\n", rs->checksum);
+		status = STATUS_IO_DEVICE_ERROR;
+		goto out;
+	}
+
+	if (ec_fault_hit(EC_FAULT_SHORT, faultArmed))
+		rs->data_size--;
 
 	if (rs->result) {
 		CrosKBLightPrint(DEBUG_LEVEL_ERROR, DBG_IOCTL,
@@ -250,10 +523,10 @@ NTSTATUS wilco_ec_mailbox(PCROSKBLIGHT_CONTEXT pDevice, struct wilco_ec_message
 		goto out;
 	}
 
-	if (rs->data_size != EC_MAILBOX_DATA_SIZE) {
+	if (rs->data_size != size) {
 		CrosKBLightPrint(DEBUG_LEVEL_ERROR, DBG_IOCTL,
-			"unexpected packet size (%u != %u)\n",
-			rs->data_size, EC_MAILBOX_DATA_SIZE);
+			"unexpected packet size (%u != %zu)\n",
+			rs->data_size, size);
 		status = STATUS_IO_DEVICE_ERROR;
 		goto out;
 	}
@@ -268,7 +541,20 @@ NTSTATUS wilco_ec_mailbox(PCROSKBLIGHT_CONTEXT pDevice, struct wilco_ec_message
 
 	RtlCopyMemory(msg->response_data, rs->data, msg->response_size);
 
+	/* Legacy command responses carry their status in the second byte */
+	if (ec_fault_hit(EC_FAULT_KBBL_STATUS, faultArmed && msg->response_size > 1))
+		((UINT8*)msg->response_data)[1] = 0xFF;
+
 out:
+	pDevice->ecPortLast = pDevice->ecPortOps;
+	if (portOps)
+		*portOps = pDevice->ecPortOps;
+	pDevice->ecPortTotal.Reads += pDevice->ecPortOps.Reads;
+	pDevice->ecPortTotal.Writes += pDevice->ecPortOps.Writes;
+	pDevice->ecPortTotal.AddressWrites += pDevice->ecPortOps.AddressWrites;
+	pDevice->ecPortTotal.StatusPolls += pDevice->ecPortOps.StatusPolls;
+
+	CrosKBLightRecordLatency(&pDevice->ecLockHoldStats, holdStart, status);
 	WdfWaitLockRelease(pDevice->ecLock);
 	return status;
 }
@@ -279,8 +565,19 @@ NTSTATUS comm_init_lpc_mec(PCROSKBLIGHT_CONTEXT pDevice)
 
 	ExInitializeFastMutex(&MecAccessMutex);
 
+#ifdef CROSKBLIGHT_PORT_TRACE
+	/*
+	 * The ring outlives a stop/start, so take the epoch only once; time_us
+	 * must not go backwards within it.
+	 */
+	if (!ec_port_trace_start.QuadPart) {
+		LARGE_INTEGER start = KeQueryPerformanceCounter(&ec_port_trace_freq);
+		InterlockedCompareExchange64(&ec_port_trace_start.QuadPart, start.QuadPart, 0);
+	}
+#endif
+
 	mec_emi_base = pDevice->ecIoPacket.Start.LowPart;
-	mec_emi_end = pDevice->ecIoPacket.Start.LowPart + EC_MAILBOX_DATA_SIZE;
+	mec_emi_end = pDevice->ecIoPacket.Start.LowPart + EC_MAILBOX_DATA_SIZE_EXTENDED;
 
 	return STATUS_SUCCESS;
 }
\ No newline at end of file
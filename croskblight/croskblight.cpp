@@ -4,13 +4,23 @@
 #include <ntstrsafe.h>
 
 extern "C" NTSTATUS comm_init_lpc_mec(PCROSKBLIGHT_CONTEXT pDevice);
-extern "C" NTSTATUS wilco_ec_mailbox(PCROSKBLIGHT_CONTEXT pDevice, struct wilco_ec_message* msg);
+extern "C" NTSTATUS wilco_ec_mailbox(PCROSKBLIGHT_CONTEXT pDevice, struct wilco_ec_message* msg,
+	PCROSKBLIGHT_PORT_STATS portOps);
+extern "C" EVT_WDF_INTERRUPT_ISR wilco_ec_isr;
+extern "C" EVT_WDF_INTERRUPT_DPC wilco_ec_dpc;
 
 VOID
 CrosKBLightS0ixNotifyCallback(
 	PCROSKBLIGHT_CONTEXT pDevice,
 	ULONG NotifyCode);
 
+EVT_WDF_TIMER CrosKBLightVerifyTimerFunc;
+EVT_WDF_TIMER CrosKBLightS0ixTimerFunc;
+EVT_WDF_TIMER CrosKBLightPersistTimerFunc;
+EVT_WDF_TIMER CrosKBLightLampTimerFunc;
+EVT_WDF_TIMER CrosKBLightRateTimerFunc;
+EVT_WDF_WORKITEM CrosKBLightProbeWorkItem;
+
 static ULONG CrosKBLightDebugLevel = 100;
 static ULONG CrosKBLightDebugCatagories = DBG_INIT || DBG_PNP || DBG_IOCTL;
 
@@ -18,6 +28,45 @@ static ULONG CrosKBLightDebugCatagories = DBG_INIT || DBG_PNP || DBG_IOCTL;
 #define WILCO_KBBL_MODE_FLAG_PWM	BIT(1)	/* Set brightness by percent. */
 #define WILCO_KBBL_DEFAULT_BRIGHTNESS   0
 
+/* Idle time after a posted SET_STATE before reading the state back */
+#define KBBL_VERIFY_IDLE_MS		250
+
+/* Window in which opposing S0ix notifications cancel each other out */
+#define S0IX_DEBOUNCE_MS		20
+
+/* Brightness changes inside this window share one registry write */
+#define BRIGHTNESS_PERSIST_DELAY_MS	2000
+
+/*
+ * LampArray frames inside this window share one EC write. The keyboard is a
+ * single zone, so only the last frame of a burst is ever visible anyway.
+ */
+#define LAMPARRAY_COALESCE_MS		33
+
+/*
+ * Default EC-bound brightness writes per second for each client and for all
+ * clients together, and how many a client may send back to back. Overridden
+ * by the RateLimit, GlobalRateLimit and RateBurst settings; RateLimit 0
+ * turns limiting off.
+ */
+#define RATE_LIMIT_DEFAULT		20
+#define RATE_GLOBAL_LIMIT_DEFAULT	50
+#define RATE_BURST_DEFAULT		10
+#define RATE_TOKEN_SCALE		1000
+
+/*
+ * Upper bounds for the rate settings. The refill product in rate_take is at
+ * most 10^7 * burst * rate * RATE_TOKEN_SCALE, about 10^16 here, so it can't
+ * overflow.
+ */
+#define RATE_LIMIT_MAX			1000
+#define RATE_BURST_MAX			1000
+
+/* Approximate keyboard extents, reported to LampArray clients */
+#define LAMPARRAY_WIDTH_UM		280000
+#define LAMPARRAY_HEIGHT_UM		100000
+#define LAMPARRAY_DEPTH_UM		5000
+
 enum wilco_kbbl_subcommand {
 	WILCO_KBBL_SUBCMD_GET_FEATURES = 0x00,
 	WILCO_KBBL_SUBCMD_GET_STATE = 0x01,
@@ -48,44 +97,253 @@ struct wilco_keyboard_leds_msg {
 };
 #include <poppack.h>
 
-/* Send a request, get a response, and check that the response is good. */
+static CROSKBLIGHT_STATE
+CrosKBLightReadState(
+	_In_ PCROSKBLIGHT_CONTEXT pDevice
+	)
+{
+	CROSKBLIGHT_STATE state;
+
+#if defined(_WIN64)
+	state.Value = ReadAcquire64(&pDevice->State);
+#else
+	state.Value = InterlockedCompareExchange64(&pDevice->State, 0, 0);
+#endif
+
+	return state;
+}
+
+static void
+CrosKBLightPublishBrightness(
+	_In_ PCROSKBLIGHT_CONTEXT pDevice,
+	UINT8 Brightness
+	)
+{
+	CROSKBLIGHT_STATE oldState, newState;
+
+	do {
+		oldState = CrosKBLightReadState(pDevice);
+		newState = oldState;
+		newState.Brightness = Brightness;
+		newState.Generation++;
+	} while (InterlockedCompareExchange64(&pDevice->State,
+		newState.Value, oldState.Value) != oldState.Value);
+}
+
+/*
+ * Record the outcome of an EC exchange. On failure the EC mode is no longer
+ * known and the error is kept until the next failure replaces it.
+ */
+static void
+CrosKBLightPublishEcResult(
+	_In_ PCROSKBLIGHT_CONTEXT pDevice,
+	UINT8 Mode,
+	NTSTATUS Status
+	)
+{
+	CROSKBLIGHT_STATE oldState, newState;
+
+	do {
+		oldState = CrosKBLightReadState(pDevice);
+		newState = oldState;
+		if (NT_SUCCESS(Status)) {
+			newState.Mode = Mode;
+		}
+		else {
+			newState.Mode = 0;
+			newState.LastError = Status;
+		}
+	} while (InterlockedCompareExchange64(&pDevice->State,
+		newState.Value, oldState.Value) != oldState.Value);
+}
+
+#if DBG
+/*
+ * Expected port operations per KBBL command, excluding status polls. Every
+ * KBBL message is 16 bytes, so a full exchange is: 8 byte header write
+ * (1 address + 4 data), 16 byte request write (1 address + 8 data), start
+ * command, result flag read and a 40 byte response read (1 address +
+ * 20 data). A posted write stops after the start command.
+ *
+ * Update this table only together with an intended transport change. A
+ * mismatch breaks into the debugger on checked builds. The check runs in
+ * send_kbbl_msg after ecLock is released, never inside a transfer.
+ */
+static const struct kbbl_port_budget {
+	UINT8 subcmd;
+	BOOLEAN posted;
+	ULONG64 reads;
+	ULONG64 writes;
+	ULONG64 addressWrites;
+} kbbl_port_budgets[] = {
+	{ WILCO_KBBL_SUBCMD_GET_FEATURES, FALSE, 21, 16, 3 },
+	{ WILCO_KBBL_SUBCMD_GET_STATE, FALSE, 21, 16, 3 },
+	{ WILCO_KBBL_SUBCMD_SET_STATE, FALSE, 21, 16, 3 },
+	{ WILCO_KBBL_SUBCMD_SET_STATE, TRUE, 0, 15, 2 },
+};
+
+static void kbbl_check_port_budget(_In_ PCROSKBLIGHT_PORT_STATS ops, UINT8 subcmd, BOOLEAN posted)
+{
+	for (int i = 0; i < ARRAYSIZE(kbbl_port_budgets); i++) {
+		const struct kbbl_port_budget* budget = &kbbl_port_budgets[i];
+		if (budget->subcmd != subcmd || budget->posted != posted)
+			continue;
+
+		if (ops->Reads - ops->StatusPolls != budget->reads ||
+			ops->Writes != budget->writes ||
+			ops->AddressWrites != budget->addressWrites) {
+			CrosKBLightPrint(DEBUG_LEVEL_ERROR, DBG_IOCTL,
+				"KBBL subcmd %d port budget exceeded: %llu/%llu/%llu, expected %llu/%llu/%llu\n",
+				subcmd,
+				ops->Reads - ops->StatusPolls, ops->Writes, ops->AddressWrites,
+				budget->reads, budget->writes, budget->addressWrites);
+			NT_ASSERTMSG("KBBL port budget mismatch", FALSE);
+		}
+		return;
+	}
+}
+#else
+#define kbbl_check_port_budget(ops, subcmd, posted)
+#endif
+
+/**
+ * struct wilco_ec_command - Compile-time description of an EC command.
+ * @Type: Mailbox message type.
+ * @Request: Request structure, sent as the whole request payload.
+ * @Response: Response structure, copied from the start of the response data.
+ * @ResponseSize: Size of the response data the EC returns for this command.
+ *
+ * @header_sum is the 8-bit sum of the constant wilco_ec_request header for
+ * this command, folded at compile time. Senders must take the message type
+ * and request size from @type and @request_type so the header they send is
+ * the one @header_sum was folded from.
+ */
+template <enum wilco_ec_msg_type Type, typename Request, typename Response,
+	size_t ResponseSize = EC_MAILBOX_DATA_SIZE>
+struct wilco_ec_command {
+	static_assert(ResponseSize == EC_MAILBOX_DATA_SIZE ||
+		ResponseSize == EC_MAILBOX_DATA_SIZE_EXTENDED,
+		"EC responses are either normal or extended size");
+	static_assert(sizeof(Request) <= EC_MAILBOX_DATA_SIZE,
+		"request does not fit in the mailbox");
+	static_assert(sizeof(Response) <= ResponseSize,
+		"response is larger than the EC returns");
+
+	typedef Request request_type;
+	typedef Response response_type;
+
+	static const enum wilco_ec_msg_type type = Type;
+
+	static const UINT8 flags = (ResponseSize == EC_MAILBOX_DATA_SIZE_EXTENDED) ?
+		WILCO_EC_FLAG_EXTENDED_DATA : 0;
+
+	static const UINT8 header_sum = (UINT8)(EC_MAILBOX_PROTO_VERSION +
+		(Type & 0xFF) + ((Type >> 8) & 0xFF) +
+		EC_MAILBOX_VERSION +
+		(sizeof(Request) & 0xFF) + ((sizeof(Request) >> 8) & 0xFF));
+};
+
+static_assert(sizeof(struct wilco_ec_request) == 8,
+	"header_sum assumes the 8 byte mailbox request header");
+static_assert(sizeof(struct wilco_keyboard_leds_msg) == 16,
+	"KBBL messages are 16 bytes");
+static_assert(FIELD_OFFSET(struct wilco_keyboard_leds_msg, status) == 1 &&
+	FIELD_OFFSET(struct wilco_keyboard_leds_msg, mode) == 4 &&
+	FIELD_OFFSET(struct wilco_keyboard_leds_msg, percent) == 9,
+	"KBBL message layout does not match the EC");
+
+/**
+ * struct kbbl_command - A KBBL subcommand with its fixed fields.
+ * @Subcmd: One of enum wilco_kbbl_subcommand.
+ * @Mode: Fixed mode flags sent with the request.
+ *
+ * Only @percent varies at runtime, so the request checksum is the folded
+ * header and fixed-field sum plus that one byte.
+ */
+template <enum wilco_kbbl_subcommand Subcmd, UINT8 Mode = 0>
+struct kbbl_command : wilco_ec_command<WILCO_EC_MSG_LEGACY,
+	struct wilco_keyboard_leds_msg, struct wilco_keyboard_leds_msg> {
+	static const UINT8 subcmd = Subcmd;
+
+	static const UINT8 fixed_sum = (UINT8)(header_sum +
+		WILCO_EC_COMMAND_KBBL + Subcmd + Mode);
+
+	static void build(struct wilco_keyboard_leds_msg* request, UINT8 percent) {
+		memset(request, 0, sizeof(*request));
+		request->command = WILCO_EC_COMMAND_KBBL;
+		request->subcmd = Subcmd;
+		request->mode = Mode;
+		request->percent = percent;
+	}
+
+	static UINT8 checksum(UINT8 percent) {
+		return (UINT8)-(UINT8)(fixed_sum + percent);
+	}
+};
+
+typedef kbbl_command<WILCO_KBBL_SUBCMD_GET_FEATURES> kbbl_get_features;
+typedef kbbl_command<WILCO_KBBL_SUBCMD_GET_STATE> kbbl_get_state;
+typedef kbbl_command<WILCO_KBBL_SUBCMD_SET_STATE, WILCO_KBBL_MODE_FLAG_PWM> kbbl_set_state;
+
+/*
+ * Send a request, get a response, and check that the response is good.
+ * Pass WILCO_EC_FLAG_NO_RESPONSE in @flags to post the request instead, in
+ * which case @response is not touched.
+ */
+template <class Command>
 static NTSTATUS send_kbbl_msg(_In_ PCROSKBLIGHT_CONTEXT pDevice,
-	struct wilco_keyboard_leds_msg* request,
-	struct wilco_keyboard_leds_msg* response)
+	UINT8 percent,
+	struct wilco_keyboard_leds_msg* response,
+	UINT8 flags = 0,
+	WDFREQUEST wdfRequest = NULL)
 {
+	typename Command::request_type request;
 	struct wilco_ec_message msg;
 	NTSTATUS status;
 
-	memset(&msg, 0, sizeof(msg));
-	msg.type = WILCO_EC_MSG_LEGACY;
-	msg.request_data = request;
-	msg.request_size = sizeof(*request);
-	msg.response_data = response;
-	msg.response_size = sizeof(*response);
+	static_assert(sizeof(typename Command::response_type) == sizeof(*response),
+		"response buffer does not match the command");
+#if DBG
+	CROSKBLIGHT_PORT_STATS portOps;
+#endif
+
+	Command::build(&request, percent);
 
-	status = wilco_ec_mailbox(pDevice, &msg);
+	memset(&msg, 0, sizeof(msg));
+	msg.type = Command::type;
+	msg.flags = (UINT8)(Command::flags | WILCO_EC_FLAG_CHECKSUM_VALID | flags);
+	msg.request_data = &request;
+	msg.request_size = sizeof(request);
+	msg.request_checksum = Command::checksum(percent);
+	msg.request = wdfRequest;
+	if (!(flags & WILCO_EC_FLAG_NO_RESPONSE)) {
+		msg.response_data = response;
+		msg.response_size = sizeof(*response);
+	}
+#if DBG
+	status = wilco_ec_mailbox(pDevice, &msg, &portOps);
+#else
+	status = wilco_ec_mailbox(pDevice, &msg, NULL);
+#endif
 	if (!NT_SUCCESS(status)) {
 		CrosKBLightPrint(DEBUG_LEVEL_ERROR, DBG_IOCTL,
 			"Failed sending keyboard LEDs command: 0x%x\n", status);
+		CrosKBLightPublishEcResult(pDevice, 0, status);
 		return status;
 	}
 
+	kbbl_check_port_budget(&portOps, Command::subcmd,
+		(flags & WILCO_EC_FLAG_NO_RESPONSE) != 0);
+
 	return status;
 }
 
 static NTSTATUS set_kbbl(_In_ PCROSKBLIGHT_CONTEXT pDevice, UINT8 brightness)
 {
-	struct wilco_keyboard_leds_msg request;
 	struct wilco_keyboard_leds_msg response;
 	NTSTATUS status;
 
-	memset(&request, 0, sizeof(request));
-	request.command = WILCO_EC_COMMAND_KBBL;
-	request.subcmd = WILCO_KBBL_SUBCMD_SET_STATE;
-	request.mode = WILCO_KBBL_MODE_FLAG_PWM;
-	request.percent = brightness;
-
-	status = send_kbbl_msg(pDevice, &request, &response);
+	status = send_kbbl_msg<kbbl_set_state>(pDevice, brightness, &response);
 	if (!NT_SUCCESS(status))
 		return status;
 
@@ -93,12 +351,35 @@ static NTSTATUS set_kbbl(_In_ PCROSKBLIGHT_CONTEXT pDevice, UINT8 brightness)
 		CrosKBLightPrint(DEBUG_LEVEL_INFO, DBG_INIT,
 			"EC reported failure sending keyboard LEDs command: %d\n",
 			response.status);
+		CrosKBLightPublishEcResult(pDevice, 0, STATUS_IO_DEVICE_ERROR);
 		return STATUS_IO_DEVICE_ERROR;
 	}
 
+	/* The EC acknowledged SET_STATE, so it is in PWM mode now */
+	CrosKBLightPublishEcResult(pDevice, WILCO_KBBL_MODE_FLAG_PWM, STATUS_SUCCESS);
+
 	return status;
 }
 
+/**
+ * set_kbbl_posted() - Set the brightness without waiting for the EC.
+ * @pDevice: Device context.
+ * @brightness: Brightness in 0-100.
+ * @flags: Extra message flags, e.g. %WILCO_EC_FLAG_BOUNDED.
+ * @wdfRequest: Request being served, so a cancel ends the wait for the EC.
+ *
+ * Sends SET_STATE as a posted write and returns as soon as the command is
+ * started. Callers that want the write verified arm verifyTimer afterwards.
+ *
+ * Return: Status of starting the command.
+ */
+static NTSTATUS set_kbbl_posted(_In_ PCROSKBLIGHT_CONTEXT pDevice, UINT8 brightness, UINT8 flags,
+	WDFREQUEST wdfRequest = NULL)
+{
+	return send_kbbl_msg<kbbl_set_state>(pDevice, brightness, NULL,
+		WILCO_EC_FLAG_NO_RESPONSE | flags, wdfRequest);
+}
+
 /**
  * kbbl_init() - Initialize the state of the keyboard backlight.
  * @ec: EC device to talk to.
@@ -111,15 +392,10 @@ static NTSTATUS set_kbbl(_In_ PCROSKBLIGHT_CONTEXT pDevice, UINT8 brightness)
  */
 static int kbbl_init(_In_ PCROSKBLIGHT_CONTEXT pDevice)
 {
-	struct wilco_keyboard_leds_msg request;
 	struct wilco_keyboard_leds_msg response;
 	NTSTATUS status;
 
-	memset(&request, 0, sizeof(request));
-	request.command = WILCO_EC_COMMAND_KBBL;
-	request.subcmd = WILCO_KBBL_SUBCMD_GET_STATE;
-
-	status = send_kbbl_msg(pDevice, &request, &response);
+	status = send_kbbl_msg<kbbl_get_state>(pDevice, 0, &response);
 	if (!NT_SUCCESS(status))
 		return status;
 
@@ -127,12 +403,14 @@ static int kbbl_init(_In_ PCROSKBLIGHT_CONTEXT pDevice)
 		CrosKBLightPrint(DEBUG_LEVEL_INFO, DBG_INIT,
 			"EC reported failure sending keyboard LEDs command: %d\n",
 			response.status);
+		CrosKBLightPublishEcResult(pDevice, 0, STATUS_IO_DEVICE_ERROR);
 		return STATUS_IO_DEVICE_ERROR;
 	}
 
 	if (response.mode & WILCO_KBBL_MODE_FLAG_PWM) {
-		if (pDevice->currentBrightness == 0)
-			pDevice->currentBrightness = response.percent;
+		if (CrosKBLightReadState(pDevice).Brightness == 0 && !pDevice->brightnessRestored)
+			CrosKBLightPublishBrightness(pDevice, response.percent);
+		CrosKBLightPublishEcResult(pDevice, response.mode, STATUS_SUCCESS);
 		return STATUS_SUCCESS;
 	}
 
@@ -145,15 +423,10 @@ static int kbbl_init(_In_ PCROSKBLIGHT_CONTEXT pDevice)
 
 static NTSTATUS kbbl_exist(_In_ PCROSKBLIGHT_CONTEXT pDevice, BOOLEAN* exists)
 {
-	struct wilco_keyboard_leds_msg request;
 	struct wilco_keyboard_leds_msg response;
 	NTSTATUS status;
 
-	memset(&request, 0, sizeof(request));
-	request.command = WILCO_EC_COMMAND_KBBL;
-	request.subcmd = WILCO_KBBL_SUBCMD_GET_FEATURES;
-
-	status = send_kbbl_msg(pDevice, &request, &response);
+	status = send_kbbl_msg<kbbl_get_features>(pDevice, 0, &response);
 	if (!NT_SUCCESS(status))
 		return status;
 
@@ -162,6 +435,92 @@ static NTSTATUS kbbl_exist(_In_ PCROSKBLIGHT_CONTEXT pDevice, BOOLEAN* exists)
 	return STATUS_SUCCESS;
 }
 
+/*
+ * Brightness the backlight should show: the vendor setting, or the last
+ * LampArray frame while a LampArray client has taken control.
+ */
+static UINT8 kbbl_target(_In_ PCROSKBLIGHT_CONTEXT pDevice)
+{
+	if (!pDevice->lampAutonomous)
+		return (UINT8)pDevice->lampTarget;
+
+	return CrosKBLightReadState(pDevice).Brightness;
+}
+
+static NTSTATUS
+CrosKBLightOpenSettingsKey(
+	_In_ WDFDEVICE FxDevice,
+	_In_ ACCESS_MASK DesiredAccess,
+	_Out_ WDFKEY* SettingsKey
+	)
+{
+	NTSTATUS status;
+	WDFKEY hwKey;
+	DECLARE_CONST_UNICODE_STRING(settingsName, L"Settings");
+
+	status = WdfDeviceOpenRegistryKey(FxDevice,
+		PLUGPLAY_REGKEY_DEVICE,
+		DesiredAccess,
+		WDF_NO_OBJECT_ATTRIBUTES,
+		&hwKey);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	status = WdfRegistryCreateKey(hwKey,
+		&settingsName,
+		DesiredAccess,
+		REG_OPTION_NON_VOLATILE,
+		NULL,
+		WDF_NO_OBJECT_ATTRIBUTES,
+		SettingsKey);
+
+	WdfRegistryClose(hwKey);
+	return status;
+}
+
+static NTSTATUS
+CrosKBLightQuerySetting(
+	_In_ WDFDEVICE FxDevice,
+	_In_ PCUNICODE_STRING ValueName,
+	_Out_ PULONG Value
+	)
+{
+	NTSTATUS status;
+	WDFKEY settingsKey;
+
+	status = CrosKBLightOpenSettingsKey(FxDevice, KEY_READ, &settingsKey);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	status = WdfRegistryQueryULong(settingsKey, ValueName, Value);
+
+	WdfRegistryClose(settingsKey);
+	return status;
+}
+
+static NTSTATUS
+CrosKBLightSaveSetting(
+	_In_ WDFDEVICE FxDevice,
+	_In_ PCUNICODE_STRING ValueName,
+	_In_ ULONG Value
+	)
+{
+	NTSTATUS status;
+	WDFKEY settingsKey;
+
+	status = CrosKBLightOpenSettingsKey(FxDevice, KEY_READ | KEY_SET_VALUE, &settingsKey);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	status = WdfRegistryAssignULong(settingsKey, ValueName, Value);
+
+	WdfRegistryClose(settingsKey);
+	return status;
+}
+
 NTSTATUS
 DriverEntry(
 	__in PDRIVER_OBJECT  DriverObject,
@@ -199,6 +558,53 @@ DriverEntry(
 	return status;
 }
 
+VOID
+CrosKBLightRecordLatency(
+	_Inout_ PCROSKBLIGHT_LATENCY_STATS Stats,
+	_In_ LARGE_INTEGER Start,
+	_In_ NTSTATUS Status
+	)
+{
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER end = KeQueryPerformanceCounter(&frequency);
+	LONG64 elapsedUs = ((end.QuadPart - Start.QuadPart) * 1000 * 1000) / frequency.QuadPart;
+	LONG64 maxUs;
+
+	//
+	// Callers may run concurrently (parallel dispatch), so every field is
+	// updated atomically.
+	//
+
+	InterlockedIncrement(&Stats->Count);
+	if (!NT_SUCCESS(Status))
+		InterlockedIncrement(&Stats->Failures);
+	InterlockedExchange64(&Stats->LastUs, elapsedUs);
+	InterlockedAdd64(&Stats->TotalUs, elapsedUs);
+
+	maxUs = Stats->MaxUs;
+	while (elapsedUs > maxUs) {
+		LONG64 prevUs = InterlockedCompareExchange64(&Stats->MaxUs, elapsedUs, maxUs);
+		if (prevUs == maxUs)
+			break;
+		maxUs = prevUs;
+	}
+}
+
+//
+// Forget any debounced S0ix transition. Called while notifications are not
+// registered, so a new registration starts from "not in S0ix".
+//
+
+static void
+CrosKBLightResetS0ix(PCROSKBLIGHT_CONTEXT pDevice)
+{
+	WdfSpinLockAcquire(pDevice->s0ixLock);
+	pDevice->s0ixPending = FALSE;
+	pDevice->s0ixTarget = FALSE;
+	pDevice->s0ixApplied = FALSE;
+	WdfSpinLockRelease(pDevice->s0ixLock);
+}
+
 NTSTATUS
 OnPrepareHardware(
 	_In_  WDFDEVICE     FxDevice,
@@ -227,8 +633,7 @@ OnPrepareHardware(
 {
 	PCROSKBLIGHT_CONTEXT pDevice = GetDeviceContext(FxDevice);
 	NTSTATUS status = STATUS_SUCCESS;
-
-	UNREFERENCED_PARAMETER(FxResourcesRaw);
+	LARGE_INTEGER start = KeQueryPerformanceCounter(NULL);
 
 	//
 	// Parse the peripheral's resources.
@@ -237,6 +642,8 @@ OnPrepareHardware(
 	ULONG resourceCount = WdfCmResourceListGetCount(FxResourcesTranslated);
 
 	ULONG portsFound = 0;
+	PCM_PARTIAL_RESOURCE_DESCRIPTOR interruptRaw = NULL;
+	PCM_PARTIAL_RESOURCE_DESCRIPTOR interruptTranslated = NULL;
 	for (ULONG i = 0; i < resourceCount; i++)
 	{
 		PCM_PARTIAL_RESOURCE_DESCRIPTOR pDescriptor;
@@ -271,6 +678,12 @@ OnPrepareHardware(
 
 			portsFound++;
 			break;
+		case CmResourceTypeInterrupt:
+			if (!interruptTranslated) {
+				interruptRaw = WdfCmResourceListGetDescriptor(FxResourcesRaw, i);
+				interruptTranslated = pDescriptor;
+			}
+			break;
 		default:
 			//
 			// Ignoring all other resource types.
@@ -279,27 +692,152 @@ OnPrepareHardware(
 		}
 	}
 
+	CrosKBLightPublishEcResult(pDevice, 0, STATUS_SUCCESS);
+
 	if (portsFound < 3) {
 		status = STATUS_NOT_FOUND;
 		return status;
 	}
 
-	pDevice->dataBuffer = ExAllocatePoolZero(NonPagedPool, sizeof(struct wilco_ec_response) + EC_MAILBOX_DATA_SIZE, CROSKBLIGHT_POOL_TAG);
+	//
+	// ReleaseHardware frees this on every stop, so nothing may be left over
+	// from an earlier start.
+	//
+
+	NT_ASSERT(pDevice->dataBuffer == NULL && pDevice->poolAllocations == 0);
+
+	pDevice->dataBuffer = ExAllocatePoolZero(NonPagedPool, sizeof(struct wilco_ec_response) + EC_MAILBOX_DATA_SIZE_EXTENDED, CROSKBLIGHT_POOL_TAG);
 	if (!pDevice->dataBuffer) {
 		status = STATUS_NO_MEMORY;
 		return status;
 	}
+	InterlockedIncrement(&pDevice->poolAllocations);
+
+	//
+	// Undo the previous ReleaseHardware: allow EC transactions again and let
+	// the purged EC queue take requests.
+	//
+
+	InterlockedExchange(&pDevice->ecStopping, 0);
+	WdfIoQueueStart(pDevice->EcQueue);
 
 	status = comm_init_lpc_mec(pDevice);
 	if (!NT_SUCCESS(status)) {
 		return status;
 	}
 
-	status = kbbl_exist(pDevice, &pDevice->ledExists);
-	if (!NT_SUCCESS(status)) {
-		return status;
+	//
+	// With ConnectInterrupt set, let the EC interrupt wake mailbox waits
+	// between polls of the command port. WDF connects it while in D0 and
+	// deletes it after ReleaseHardware. Polling stays as the fallback if the
+	// interrupt can't be created. A level-triggered line is never connected:
+	// the ISR only claims it while a wait is armed, so it could storm.
+	//
+
+	pDevice->ecInterrupt = NULL;
+	if (interruptTranslated) {
+		DECLARE_CONST_UNICODE_STRING(connectInterruptName, L"ConnectInterrupt");
+		ULONG connectInterrupt;
+
+		if (!NT_SUCCESS(CrosKBLightQuerySetting(FxDevice, &connectInterruptName, &connectInterrupt))) {
+			connectInterrupt = 0;
+		}
+
+		if (connectInterrupt && !(interruptTranslated->Flags & CM_RESOURCE_INTERRUPT_LATCHED)) {
+			CrosKBLightPrint(DEBUG_LEVEL_ERROR, DBG_PNP,
+				"EC interrupt is level-triggered, polling the EC\n");
+		}
+		else if (connectInterrupt) {
+			WDF_INTERRUPT_CONFIG interruptConfig;
+			WDFINTERRUPT interrupt;
+
+			WDF_INTERRUPT_CONFIG_INIT(&interruptConfig, wilco_ec_isr, wilco_ec_dpc);
+			interruptConfig.InterruptRaw = interruptRaw;
+			interruptConfig.InterruptTranslated = interruptTranslated;
+
+			status = WdfInterruptCreate(FxDevice, &interruptConfig, WDF_NO_OBJECT_ATTRIBUTES, &interrupt);
+			if (NT_SUCCESS(status)) {
+				pDevice->ecInterrupt = interrupt;
+			}
+			else {
+				CrosKBLightPrint(DEBUG_LEVEL_ERROR, DBG_PNP,
+					"WdfInterruptCreate failed 0x%x, polling the EC\n", status);
+				status = STATUS_SUCCESS;
+			}
+		}
+	}
+
+	//
+	// Start with the result of the last probe so a warm boot doesn't wait on
+	// the EC. The probe itself runs in the background once D0Entry is done
+	// and refreshes the cache.
+	//
+
+	{
+		DECLARE_CONST_UNICODE_STRING(ledExistsName, L"LedExists");
+		ULONG ledExists;
+
+		if (NT_SUCCESS(CrosKBLightQuerySetting(FxDevice, &ledExistsName, &ledExists))) {
+			pDevice->ledExists = ledExists != 0;
+		}
+		else {
+			pDevice->ledExists = FALSE;
+		}
 	}
 
+	//
+	// Restore the brightness saved by the write-behind timer so D0Entry can
+	// apply it without reading the state back from the EC first. The saved
+	// value is the report byte as written, so accept the report's 0-255 range.
+	//
+
+	{
+		DECLARE_CONST_UNICODE_STRING(brightnessName, L"Brightness");
+		ULONG brightness;
+
+		if (NT_SUCCESS(CrosKBLightQuerySetting(FxDevice, &brightnessName, &brightness)) &&
+			brightness <= MAXUINT8) {
+			CrosKBLightPublishBrightness(pDevice, (UINT8)brightness);
+			pDevice->persistedGeneration = CrosKBLightReadState(pDevice).Generation;
+			pDevice->persistedBrightness = (UINT8)brightness;
+			pDevice->brightnessRestored = TRUE;
+		}
+	}
+
+	//
+	// Rate limits for EC-bound writes. The buckets start full, so a restart
+	// doesn't throttle the first writes.
+	//
+
+	{
+		DECLARE_CONST_UNICODE_STRING(rateLimitName, L"RateLimit");
+		DECLARE_CONST_UNICODE_STRING(rateGlobalLimitName, L"GlobalRateLimit");
+		DECLARE_CONST_UNICODE_STRING(rateBurstName, L"RateBurst");
+		DECLARE_CONST_UNICODE_STRING(rateStrictName, L"RateLimitStrict");
+		ULONG value;
+
+		pDevice->rateLimit = RATE_LIMIT_DEFAULT;
+		if (NT_SUCCESS(CrosKBLightQuerySetting(FxDevice, &rateLimitName, &value)))
+			pDevice->rateLimit = min(value, RATE_LIMIT_MAX);
+
+		pDevice->rateGlobalLimit = RATE_GLOBAL_LIMIT_DEFAULT;
+		if (NT_SUCCESS(CrosKBLightQuerySetting(FxDevice, &rateGlobalLimitName, &value)) && value)
+			pDevice->rateGlobalLimit = min(value, RATE_LIMIT_MAX);
+
+		pDevice->rateBurst = RATE_BURST_DEFAULT;
+		if (NT_SUCCESS(CrosKBLightQuerySetting(FxDevice, &rateBurstName, &value)) && value)
+			pDevice->rateBurst = min(value, RATE_BURST_MAX);
+
+		pDevice->rateStrict = FALSE;
+		if (NT_SUCCESS(CrosKBLightQuerySetting(FxDevice, &rateStrictName, &value)))
+			pDevice->rateStrict = value != 0;
+
+		RtlZeroMemory(&pDevice->rateGlobal, sizeof(pDevice->rateGlobal));
+		RtlZeroMemory(pDevice->rateClients, sizeof(pDevice->rateClients));
+	}
+
+	InterlockedExchange(&pDevice->probePending, 1);
+
 	status = WdfFdoQueryForInterface(FxDevice,
 		&GUID_ACPI_INTERFACE_STANDARD2,
 		(PINTERFACE)&pDevice->S0ixNotifyAcpiInterface,
@@ -311,6 +849,8 @@ OnPrepareHardware(
 		return status;
 	}
 
+	CrosKBLightResetS0ix(pDevice);
+
 	status = pDevice->S0ixNotifyAcpiInterface.RegisterForDeviceNotifications(
 		pDevice->S0ixNotifyAcpiInterface.Context,
 		(PDEVICE_NOTIFY_CALLBACK2)CrosKBLightS0ixNotifyCallback,
@@ -318,6 +858,9 @@ OnPrepareHardware(
 	if (!NT_SUCCESS(status)) {
 		return status;
 	}
+	pDevice->s0ixRegistered = TRUE;
+
+	CrosKBLightRecordLatency(&pDevice->prepareStats, start, status);
 
 	return status;
 }
@@ -345,20 +888,102 @@ OnReleaseHardware(
 {
 	PCROSKBLIGHT_CONTEXT pDevice = GetDeviceContext(FxDevice);
 	NTSTATUS status = STATUS_SUCCESS;
+	LARGE_INTEGER start = KeQueryPerformanceCounter(NULL);
 
 	UNREFERENCED_PARAMETER(FxResourcesTranslated);
 
+	//
+	// Stop new EC transactions and cut short any wait in progress, then
+	// cancel what is still queued for the EC. Whatever runs after this only
+	// sees STATUS_DEVICE_NOT_READY from the mailbox.
+	//
+
+	InterlockedExchange(&pDevice->ecStopping, 1);
+	KeSetEvent(&pDevice->ecEvent, IO_NO_INCREMENT, FALSE);
+	WdfIoQueuePurgeSynchronously(pDevice->EcQueue);
+
+	if (pDevice->s0ixRegistered) { //Used for S0ix notifications
+		pDevice->S0ixNotifyAcpiInterface.UnregisterForDeviceNotifications(pDevice->S0ixNotifyAcpiInterface.Context);
+		pDevice->s0ixRegistered = FALSE;
+	}
+
+	//
+	// Drop the reference taken by WdfFdoQueryForInterface so repeated
+	// start/stop cycles don't leak it.
+	//
+
+	if (pDevice->S0ixNotifyAcpiInterface.InterfaceDereference) {
+		pDevice->S0ixNotifyAcpiInterface.InterfaceDereference(pDevice->S0ixNotifyAcpiInterface.Context);
+	}
+	RtlZeroMemory(&pDevice->S0ixNotifyAcpiInterface, sizeof(pDevice->S0ixNotifyAcpiInterface));
+
+	WdfWorkItemFlush(pDevice->probeWorkItem);
+	WdfTimerStop(pDevice->s0ixTimer, TRUE);
+	CrosKBLightResetS0ix(pDevice);
+	WdfTimerStop(pDevice->verifyTimer, TRUE);
+	WdfTimerStop(pDevice->lampTimer, TRUE);
+	WdfTimerStop(pDevice->rateTimer, TRUE);
+	InterlockedExchange(&pDevice->ratePending, 0);
+
+	WdfTimerStop(pDevice->persistTimer, TRUE);
+	if (InterlockedExchange(&pDevice->persistPending, 0)) {
+		DECLARE_CONST_UNICODE_STRING(brightnessName, L"Brightness");
+		CrosKBLightSaveSetting(FxDevice, &brightnessName, CrosKBLightReadState(pDevice).Brightness);
+	}
+
+	//
+	// Wait out a transaction that was already past the ecStopping check,
+	// so dataBuffer is no longer in use.
+	//
+
+	WdfWaitLockAcquire(pDevice->ecLock, NULL);
+	WdfWaitLockRelease(pDevice->ecLock);
+
+	//
+	// WDF deletes the interrupt once this returns, so go back to polling.
+	//
+
+	pDevice->ecInterrupt = NULL;
+
 	if (pDevice->dataBuffer) {
 		ExFreePoolWithTag(pDevice->dataBuffer, CROSKBLIGHT_POOL_TAG);
+		pDevice->dataBuffer = NULL;
+		InterlockedDecrement(&pDevice->poolAllocations);
 	}
 
-	if (pDevice->S0ixNotifyAcpiInterface.Context) { //Used for S0ix notifications
-		pDevice->S0ixNotifyAcpiInterface.UnregisterForDeviceNotifications(pDevice->S0ixNotifyAcpiInterface.Context);
-	}
+	CrosKBLightRecordLatency(&pDevice->releaseStats, start, status);
 
 	return status;
 }
 
+VOID
+OnSurpriseRemoval(
+	_In_  WDFDEVICE     FxDevice
+	)
+	/*++
+
+	Routine Description:
+
+	This routine stops EC transactions as soon as the device is gone,
+	rather than leaving waits to run into their timeout until
+	ReleaseHardware.
+
+	Arguments:
+
+	FxDevice - a handle to the framework device object
+
+	Return Value:
+
+	None
+
+	--*/
+{
+	PCROSKBLIGHT_CONTEXT pDevice = GetDeviceContext(FxDevice);
+
+	InterlockedExchange(&pDevice->ecStopping, 1);
+	KeSetEvent(&pDevice->ecEvent, IO_NO_INCREMENT, FALSE);
+}
+
 NTSTATUS
 OnD0Entry(
 	_In_  WDFDEVICE               FxDevice,
@@ -385,74 +1010,493 @@ OnD0Entry(
 
 	PCROSKBLIGHT_CONTEXT pDevice = GetDeviceContext(FxDevice);
 	NTSTATUS status = STATUS_SUCCESS;
+	LARGE_INTEGER start = KeQueryPerformanceCounter(NULL);
+
+	InterlockedExchange(&pDevice->suspended, 0);
+
+	//
+	// Once an exchange with the EC has confirmed PWM mode, or the brightness
+	// was restored from the registry, resume only needs to set the
+	// brightness. The full GET_STATE based init is redone otherwise.
+	//
+
+	if (pDevice->ledExists) {
+		CROSKBLIGHT_STATE state = CrosKBLightReadState(pDevice);
+
+		if (!(state.Mode & WILCO_KBBL_MODE_FLAG_PWM) && !pDevice->brightnessRestored) {
+			status = kbbl_init(pDevice);
+		}
+		if (NT_SUCCESS(status)) {
+			status = set_kbbl(pDevice, kbbl_target(pDevice));
+		}
+	}
+
+	//
+	// Queue the probe only now, so the backlight is initialized either above
+	// or by the probe, never by both at once.
+	//
+
+	if (InterlockedExchange(&pDevice->probePending, 0)) {
+		WdfWorkItemEnqueue(pDevice->probeWorkItem);
+	}
+
+	CrosKBLightRecordLatency(&pDevice->d0EntryStats, start, status);
+
+	return status;
+}
+
+NTSTATUS
+OnD0Exit(
+	_In_  WDFDEVICE               FxDevice,
+	_In_  WDF_POWER_DEVICE_STATE  FxTargetState
+	)
+	/*++
+
+	Routine Description:
+
+	This routine destroys objects needed by the driver.
+
+	Arguments:
+
+	FxDevice - a handle to the framework device object
+	FxTargetState - target power state
+
+	Return Value:
+
+	Status
+
+	--*/
+{
+	PCROSKBLIGHT_CONTEXT pDevice = GetDeviceContext(FxDevice);
+	NTSTATUS status = STATUS_SUCCESS;
+	LARGE_INTEGER start = KeQueryPerformanceCounter(NULL);
+
+	//
+	// Waiting for a running verify could block on the EC, so flag the
+	// suspend instead; the verify checks it before rewriting anything.
+	//
+
+	InterlockedExchange(&pDevice->suspended, 1);
+	WdfTimerStop(pDevice->verifyTimer, FALSE);
+	WdfTimerStop(pDevice->lampTimer, FALSE);
+	InterlockedExchange(&pDevice->lampPending, 0);
+	WdfTimerStop(pDevice->rateTimer, FALSE);
+	InterlockedExchange(&pDevice->ratePending, 0);
+	pDevice->lampWritten = -1;
+
+	//
+	// This sits on the S0ix entry path, so only post the "off" write and
+	// give up quickly if the EC is stuck behind another command.
+	//
+
+	if (FxTargetState != WdfPowerDeviceD3Final &&
+		FxTargetState != WdfPowerDevicePrepareForHibernation) {
+		if (pDevice->ledExists) {
+			status = set_kbbl_posted(pDevice, 0, WILCO_EC_FLAG_BOUNDED);
+		}
+	}
+
+	CrosKBLightRecordLatency(&pDevice->d0ExitStats, start, status);
+
+	return STATUS_SUCCESS;
+}
+
+VOID
+CrosKBLightS0ixNotifyCallback(
+	PCROSKBLIGHT_CONTEXT pDevice,
+	ULONG NotifyCode) {
+	BOOLEAN enteringS0ix = NotifyCode != 0;
+
+	//
+	// Don't touch the EC from the notify thread. Record the target state and
+	// let s0ixTimer apply it once the window passes; a transition that is
+	// undone inside the window never reaches the EC.
+	//
+
+	WdfSpinLockAcquire(pDevice->s0ixLock);
+
+	pDevice->s0ixNotifications++;
+	pDevice->s0ixTarget = enteringS0ix;
+	if (pDevice->s0ixPending && enteringS0ix == pDevice->s0ixApplied) {
+		pDevice->s0ixPending = FALSE;
+		pDevice->s0ixCollapsed++;
+		WdfTimerStop(pDevice->s0ixTimer, FALSE);
+	}
+	else if (!pDevice->s0ixPending && enteringS0ix != pDevice->s0ixApplied) {
+		pDevice->s0ixPending = TRUE;
+		WdfTimerStart(pDevice->s0ixTimer, WDF_REL_TIMEOUT_IN_MS(S0IX_DEBOUNCE_MS));
+	}
+
+	WdfSpinLockRelease(pDevice->s0ixLock);
+}
+
+VOID
+CrosKBLightS0ixTimerFunc(
+	_In_ WDFTIMER Timer
+	)
+{
+	PCROSKBLIGHT_CONTEXT pDevice = GetDeviceContext(WdfTimerGetParentObject(Timer));
+	BOOLEAN enteringS0ix;
+
+	WdfSpinLockAcquire(pDevice->s0ixLock);
+
+	if (!pDevice->s0ixPending) {
+		WdfSpinLockRelease(pDevice->s0ixLock);
+		return;
+	}
+
+	pDevice->s0ixPending = FALSE;
+	enteringS0ix = pDevice->s0ixTarget;
+	pDevice->s0ixApplied = enteringS0ix;
+
+	WdfSpinLockRelease(pDevice->s0ixLock);
+
+	//
+	// A probe that starts now leaves the backlight to us, see
+	// CrosKBLightProbeWorkItem. Only the exit path waits for one that may
+	// already be initializing it; the entry path has to stay bounded.
+	//
+
+	if (enteringS0ix) {
+		OnD0Exit(pDevice->FxDevice, WdfPowerDeviceD3);
+	}
+	else {
+		WdfWorkItemFlush(pDevice->probeWorkItem);
+		OnD0Entry(pDevice->FxDevice, WdfPowerDeviceD3);
+	}
+}
+
+VOID
+CrosKBLightVerifyTimerFunc(
+	_In_ WDFTIMER Timer
+	)
+{
+	PCROSKBLIGHT_CONTEXT pDevice = GetDeviceContext(WdfTimerGetParentObject(Timer));
+	struct wilco_keyboard_leds_msg response;
+	NTSTATUS status;
+	UINT8 brightness;
+
+	if (!pDevice->ledExists || !pDevice->lampAutonomous || pDevice->suspended)
+		return;
+
+	//
+	// OnD0Exit doesn't wait for this, so keep the read bounded. If the EC is
+	// busy, check again once it has gone idle.
+	//
+
+	status = send_kbbl_msg<kbbl_get_state>(pDevice, 0, &response, WILCO_EC_FLAG_BOUNDED);
+	if (status == STATUS_IO_TIMEOUT) {
+		if (!pDevice->suspended) {
+			WdfTimerStart(pDevice->verifyTimer,
+				WDF_REL_TIMEOUT_IN_MS(KBBL_VERIFY_IDLE_MS));
+		}
+		return;
+	}
+
+	brightness = CrosKBLightReadState(pDevice).Brightness;
+	if (NT_SUCCESS(status) && !response.status &&
+		(response.mode & WILCO_KBBL_MODE_FLAG_PWM) &&
+		response.percent == brightness)
+		return;
+
+	//
+	// The "off" write from OnD0Exit must stay the last one
+	//
+
+	if (pDevice->suspended)
+		return;
+
+	CrosKBLightPrint(DEBUG_LEVEL_INFO, DBG_IOCTL,
+		"Posted brightness not applied, rewriting %d\n", brightness);
+
+	set_kbbl(pDevice, brightness);
+}
+
+VOID
+CrosKBLightProbeWorkItem(
+	_In_ WDFWORKITEM WorkItem
+	)
+{
+	WDFDEVICE device = (WDFDEVICE)WdfWorkItemGetParentObject(WorkItem);
+	PCROSKBLIGHT_CONTEXT pDevice = GetDeviceContext(device);
+	DECLARE_CONST_UNICODE_STRING(ledExistsName, L"LedExists");
+	BOOLEAN exists = FALSE;
+	BOOLEAN wasExisting;
+	BOOLEAN inS0ix;
+	NTSTATUS status;
+
+	status = kbbl_exist(pDevice, &exists);
+	if (!NT_SUCCESS(status)) {
+		CrosKBLightPrint(DEBUG_LEVEL_ERROR, DBG_PNP,
+			"Backlight probe failed 0x%x\n", status);
+		return;
+	}
+
+	wasExisting = pDevice->ledExists;
+	pDevice->ledExists = exists;
+
+	CrosKBLightSaveSetting(device, &ledExistsName, exists);
+
+	//
+	// D0Entry skipped the backlight if the cache was cold, so restore the
+	// brightness now that we know it's there. Not while an S0ix transition
+	// is pending or in effect though: s0ixTimer owns the backlight then, and
+	// its OnD0Entry initializes it on the way out.
+	//
+
+	WdfSpinLockAcquire(pDevice->s0ixLock);
+	inS0ix = pDevice->s0ixPending || pDevice->s0ixApplied;
+	WdfSpinLockRelease(pDevice->s0ixLock);
+
+	if (exists && !wasExisting && !inS0ix && !pDevice->suspended) {
+		status = kbbl_init(pDevice);
+		if (NT_SUCCESS(status)) {
+			set_kbbl(pDevice, kbbl_target(pDevice));
+		}
+	}
+}
+
+VOID
+CrosKBLightPersistTimerFunc(
+	_In_ WDFTIMER Timer
+	)
+{
+	WDFDEVICE device = (WDFDEVICE)WdfTimerGetParentObject(Timer);
+	PCROSKBLIGHT_CONTEXT pDevice = GetDeviceContext(device);
+	DECLARE_CONST_UNICODE_STRING(brightnessName, L"Brightness");
+	CROSKBLIGHT_STATE state;
+
+	if (!InterlockedExchange(&pDevice->persistPending, 0))
+		return;
+
+	//
+	// Skip the write if nothing was published since the last save. Generation
+	// wraps, so a matching one only counts if the brightness matches too.
+	//
+
+	state = CrosKBLightReadState(pDevice);
+	if (state.Generation == pDevice->persistedGeneration &&
+		state.Brightness == pDevice->persistedBrightness)
+		return;
+
+	if (NT_SUCCESS(CrosKBLightSaveSetting(device, &brightnessName, state.Brightness))) {
+		pDevice->persistedGeneration = state.Generation;
+		pDevice->persistedBrightness = state.Brightness;
+	}
+}
+
+static void persist_brightness(PCROSKBLIGHT_CONTEXT pDevice) {
+	pDevice->brightnessRestored = TRUE;
+
+	//
+	// Only the first change in a burst arms the timer; the ones after it
+	// are picked up by that same registry write.
+	//
+
+	if (!InterlockedExchange(&pDevice->persistPending, 1)) {
+		WdfTimerStart(pDevice->persistTimer, WDF_REL_TIMEOUT_IN_MS(BRIGHTNESS_PERSIST_DELAY_MS));
+	}
+}
+
+static void update_brightness(PCROSKBLIGHT_CONTEXT pDevice, BYTE brightness) {
+	_CROSKBLIGHT_GETLIGHT_REPORT report;
+	report.ReportID = REPORTID_KBLIGHT;
+	report.Brightness = brightness;
+
+	size_t bytesWritten;
+	if (!NT_SUCCESS(CrosKBLightProcessVendorReport(pDevice, &report, sizeof(report), &bytesWritten))) {
+		//
+		// No read was pending, so the client never sees this brightness
+		//
+		InterlockedIncrement(&pDevice->droppedReports);
+	}
+}
+
+VOID
+CrosKBLightLampTimerFunc(
+	_In_ WDFTIMER Timer
+	)
+{
+	PCROSKBLIGHT_CONTEXT pDevice = GetDeviceContext(WdfTimerGetParentObject(Timer));
+	UINT8 brightness;
+
+	//
+	// Clear pending before sampling the target, so a frame that lands after
+	// this point re-arms the timer instead of being lost.
+	//
+
+	if (!InterlockedExchange(&pDevice->lampPending, 0))
+		return;
+
+	//
+	// OnD0Exit doesn't wait for this timer, so a frame that was already due
+	// must not land after its "off" write. OnD0Entry applies the target.
+	//
+
+	if (!pDevice->ledExists || pDevice->suspended)
+		return;
+
+	brightness = kbbl_target(pDevice);
+	if (brightness == pDevice->lampWritten)
+		return;
+
+	if (NT_SUCCESS(set_kbbl_posted(pDevice, brightness, 0)) && !pDevice->suspended) {
+		pDevice->lampWritten = brightness;
+		InterlockedIncrement(&pDevice->lampWrites);
+	}
+}
+
+static void lamp_schedule(PCROSKBLIGHT_CONTEXT pDevice) {
+	InterlockedIncrement(&pDevice->lampUpdates);
+
+	//
+	// Only the first frame in a window arms the timer; the ones after it just
+	// replace lampTarget.
+	//
+
+	if (!InterlockedExchange(&pDevice->lampPending, 1)) {
+		WdfTimerStart(pDevice->lampTimer, WDF_REL_TIMEOUT_IN_MS(LAMPARRAY_COALESCE_MS));
+	}
+}
+
+static void lamp_update(PCROSKBLIGHT_CONTEXT pDevice, CrosKBLightLampColor* color, BYTE flags) {
+	BYTE level = max(color->Red, max(color->Green, color->Blue));
+
+	//
+	// The backlight is a single white zone, so the brightest channel sets the
+	// level. Intensity has a single level and is ignored.
+	//
+
+	InterlockedExchange(&pDevice->lampTarget, (level * 100 + 127) / 255);
+
+	if (!pDevice->lampAutonomous && (flags & LAMP_UPDATE_FLAG_COMPLETE)) {
+		lamp_schedule(pDevice);
+	}
+}
+
+static BOOLEAN rate_take(PCROSKBLIGHT_TOKEN_BUCKET bucket, ULONG rate, ULONG burst, ULONG64 now) {
+	ULONG64 capacity = (ULONG64)burst * RATE_TOKEN_SCALE;
+	ULONG64 elapsed = now - bucket->LastRefill;
+
+	//
+	// An idle bucket is full after burst / rate seconds. Every configured
+	// rate is at least 1 per second, so clamping the elapsed time at burst
+	// seconds never loses tokens. Together with RATE_LIMIT_MAX and
+	// RATE_BURST_MAX it also keeps the refill product from overflowing.
+	//
+
+	if (bucket->LastRefill == 0 || elapsed > 10000000ULL * burst) {
+		bucket->Tokens = capacity;
+	}
+	else {
+		bucket->Tokens = min(capacity,
+			bucket->Tokens + elapsed * rate * RATE_TOKEN_SCALE / 10000000ULL);
+	}
+	bucket->LastRefill = now;
+
+	if (bucket->Tokens < RATE_TOKEN_SCALE)
+		return FALSE;
+
+	bucket->Tokens -= RATE_TOKEN_SCALE;
+	return TRUE;
+}
+
+/*
+ * Charge an EC-bound write to the requesting process and to the global
+ * bucket. rateTimer charges the global bucket too, hence rateLock.
+ */
+static BOOLEAN rate_admit(PCROSKBLIGHT_CONTEXT pDevice, WDFREQUEST Request) {
+	ULONG_PTR clientId = IoGetRequestorProcessId(WdfRequestWdmGetIrp(Request));
+	ULONG64 now = KeQueryInterruptTime();
+	PCROSKBLIGHT_TOKEN_BUCKET client = &pDevice->rateClients[0];
+	BOOLEAN admitted = FALSE;
+
+	if (!pDevice->rateLimit)
+		return TRUE;
+
+	WdfSpinLockAcquire(pDevice->rateLock);
+
+	//
+	// Reuse the least recently seen slot for a new client; its bucket would
+	// have refilled by now anyway.
+	//
 
-	if (pDevice->ledExists) {
-		status = kbbl_init(pDevice);
-		if (!NT_SUCCESS(status)) {
-			return status;
+	for (ULONG i = 0; i < CROSKBLIGHT_RATE_CLIENTS; i++) {
+		if (pDevice->rateClients[i].ClientId == clientId) {
+			client = &pDevice->rateClients[i];
+			break;
 		}
+		if (pDevice->rateClients[i].LastRefill < client->LastRefill)
+			client = &pDevice->rateClients[i];
+	}
+	if (client->ClientId != clientId) {
+		client->ClientId = clientId;
+		client->LastRefill = 0;
+	}
 
-		status = set_kbbl(pDevice, pDevice->currentBrightness);
+	if (rate_take(client, pDevice->rateLimit, pDevice->rateBurst, now)) {
+		admitted = rate_take(&pDevice->rateGlobal, pDevice->rateGlobalLimit,
+			pDevice->rateBurst, now);
+		if (!admitted)
+			client->Tokens += RATE_TOKEN_SCALE;
 	}
 
-	return status;
+	WdfSpinLockRelease(pDevice->rateLock);
+	return admitted;
 }
 
-NTSTATUS
-OnD0Exit(
-	_In_  WDFDEVICE               FxDevice,
-	_In_  WDF_POWER_DEVICE_STATE  FxTargetState
+VOID
+CrosKBLightRateTimerFunc(
+	_In_ WDFTIMER Timer
 	)
-	/*++
-
-	Routine Description:
-
-	This routine destroys objects needed by the driver.
+{
+	PCROSKBLIGHT_CONTEXT pDevice = GetDeviceContext(WdfTimerGetParentObject(Timer));
+	BOOLEAN admitted;
 
-	Arguments:
+	if (!InterlockedExchange(&pDevice->ratePending, 0))
+		return;
 
-	FxDevice - a handle to the framework device object
-	FxTargetState - target power state
+	//
+	// OnD0Exit doesn't wait for this timer, so drop the write once suspended;
+	// OnD0Entry applies the published brightness anyway.
+	//
 
-	Return Value:
+	if (pDevice->suspended)
+		return;
 
-	Status
+	//
+	// The deferred write is an EC write like any other, so it spends a global
+	// token. Without one, try again after the next refill.
+	//
 
-	--*/
-{
-	PCROSKBLIGHT_CONTEXT pDevice = GetDeviceContext(FxDevice);
+	WdfSpinLockAcquire(pDevice->rateLock);
+	admitted = rate_take(&pDevice->rateGlobal, pDevice->rateGlobalLimit,
+		pDevice->rateBurst, KeQueryInterruptTime());
+	WdfSpinLockRelease(pDevice->rateLock);
 
-	if (FxTargetState != WdfPowerDeviceD3Final &&
-		FxTargetState != WdfPowerDevicePrepareForHibernation) {
-		if (pDevice->ledExists) {
-			set_kbbl(pDevice, 0);
+	if (!admitted) {
+		if (!pDevice->suspended) {
+			InterlockedExchange(&pDevice->ratePending, 1);
+			WdfTimerStart(pDevice->rateTimer,
+				WDF_REL_TIMEOUT_IN_MS(1000 / pDevice->rateGlobalLimit + 1));
 		}
+		return;
 	}
 
-	return STATUS_SUCCESS;
-}
+	//
+	// Apply whatever the last throttled write published. LampArray may have
+	// taken over in the meantime, in which case it owns the backlight.
+	//
 
-VOID
-CrosKBLightS0ixNotifyCallback(
-	PCROSKBLIGHT_CONTEXT pDevice,
-	ULONG NotifyCode) {
-	if (NotifyCode) {
-		OnD0Exit(pDevice->FxDevice, WdfPowerDeviceD3);
-	}
-	else {
-		OnD0Entry(pDevice->FxDevice, WdfPowerDeviceD3);
+	if (pDevice->ledExists && pDevice->lampAutonomous && !pDevice->suspended) {
+		if (NT_SUCCESS(set_kbbl_posted(pDevice, CrosKBLightReadState(pDevice).Brightness, 0)) &&
+			!pDevice->suspended) {
+			WdfTimerStart(pDevice->verifyTimer,
+				WDF_REL_TIMEOUT_IN_MS(KBBL_VERIFY_IDLE_MS));
+		}
 	}
 }
 
-static void update_brightness(PCROSKBLIGHT_CONTEXT pDevice, BYTE brightness) {
-	_CROSKBLIGHT_GETLIGHT_REPORT report;
-	report.ReportID = REPORTID_KBLIGHT;
-	report.Brightness = brightness;
-
-	size_t bytesWritten;
-	CrosKBLightProcessVendorReport(pDevice, &report, sizeof(report), &bytesWritten);
-}
-
 NTSTATUS
 CrosKBLightEvtDeviceAdd(
 	IN WDFDRIVER       Driver,
@@ -491,10 +1535,22 @@ CrosKBLightEvtDeviceAdd(
 		pnpCallbacks.EvtDeviceReleaseHardware = OnReleaseHardware;
 		pnpCallbacks.EvtDeviceD0Entry = OnD0Entry;
 		pnpCallbacks.EvtDeviceD0Exit = OnD0Exit;
+		pnpCallbacks.EvtDeviceSurpriseRemoval = OnSurpriseRemoval;
 
 		WdfDeviceInitSetPnpPowerEventCallbacks(DeviceInit, &pnpCallbacks);
 	}
 
+	//
+	// Every request carries its arrival time for the per-queue latency stats
+	//
+
+	{
+		WDF_OBJECT_ATTRIBUTES requestAttributes;
+		WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&requestAttributes, CROSKBLIGHT_REQUEST_CONTEXT);
+
+		WdfDeviceInitSetRequestAttributes(DeviceInit, &requestAttributes);
+	}
+
 	//
 	// Setup the device context
 	//
@@ -568,6 +1624,29 @@ CrosKBLightEvtDeviceAdd(
 		return status;
 	}
 
+	//
+	// Create a sequential queue for requests that talk to the EC, so they
+	// never hold up the descriptor and attribute requests on the default queue
+	//
+
+	WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchSequential);
+
+	queueConfig.EvtIoInternalDeviceControl = CrosKBLightEvtEcInternalDeviceControl;
+
+	status = WdfIoQueueCreate(device,
+		&queueConfig,
+		WDF_NO_OBJECT_ATTRIBUTES,
+		&devContext->EcQueue
+		);
+
+	if (!NT_SUCCESS(status))
+	{
+		CrosKBLightPrint(DEBUG_LEVEL_ERROR, DBG_PNP,
+			"WdfIoQueueCreate failed 0x%x\n", status);
+
+		return status;
+	}
+
 	status = WdfWaitLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &devContext->ecLock);
 	if (!NT_SUCCESS(status))
 	{
@@ -577,6 +1656,162 @@ CrosKBLightEvtDeviceAdd(
 		return status;
 	}
 
+	KeInitializeEvent(&devContext->ecEvent, SynchronizationEvent, FALSE);
+
+	//
+	// Create a passive level timer to verify posted brightness writes
+	//
+
+	{
+		WDF_TIMER_CONFIG timerConfig;
+		WDF_TIMER_CONFIG_INIT(&timerConfig, CrosKBLightVerifyTimerFunc);
+
+		WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+		attributes.ParentObject = device;
+		attributes.ExecutionLevel = WdfExecutionLevelPassive;
+
+		status = WdfTimerCreate(&timerConfig, &attributes, &devContext->verifyTimer);
+		if (!NT_SUCCESS(status))
+		{
+			CrosKBLightPrint(DEBUG_LEVEL_ERROR, DBG_PNP,
+				"WdfTimerCreate failed 0x%x\n", status);
+
+			return status;
+		}
+	}
+
+	//
+	// Create the timer that coalesces LampArray frames. The backlight stays
+	// under the vendor report's control until a LampArray client clears
+	// AutonomousMode.
+	//
+
+	devContext->lampAutonomous = TRUE;
+	devContext->lampWritten = -1;
+
+	{
+		WDF_TIMER_CONFIG timerConfig;
+		WDF_TIMER_CONFIG_INIT(&timerConfig, CrosKBLightLampTimerFunc);
+
+		WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+		attributes.ParentObject = device;
+		attributes.ExecutionLevel = WdfExecutionLevelPassive;
+
+		status = WdfTimerCreate(&timerConfig, &attributes, &devContext->lampTimer);
+		if (!NT_SUCCESS(status))
+		{
+			CrosKBLightPrint(DEBUG_LEVEL_ERROR, DBG_PNP,
+				"WdfTimerCreate failed 0x%x\n", status);
+
+			return status;
+		}
+	}
+
+	//
+	// Create the timer and lock that apply writes coalesced by the rate limiter
+	//
+
+	status = WdfSpinLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &devContext->rateLock);
+	if (!NT_SUCCESS(status))
+	{
+		CrosKBLightPrint(DEBUG_LEVEL_ERROR, DBG_PNP,
+			"WdfSpinLockCreate failed 0x%x\n", status);
+
+		return status;
+	}
+
+	{
+		WDF_TIMER_CONFIG timerConfig;
+		WDF_TIMER_CONFIG_INIT(&timerConfig, CrosKBLightRateTimerFunc);
+
+		WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+		attributes.ParentObject = device;
+		attributes.ExecutionLevel = WdfExecutionLevelPassive;
+
+		status = WdfTimerCreate(&timerConfig, &attributes, &devContext->rateTimer);
+		if (!NT_SUCCESS(status))
+		{
+			CrosKBLightPrint(DEBUG_LEVEL_ERROR, DBG_PNP,
+				"WdfTimerCreate failed 0x%x\n", status);
+
+			return status;
+		}
+	}
+
+	//
+	// Create the write-behind timer that saves the brightness to the registry
+	//
+
+	{
+		WDF_TIMER_CONFIG timerConfig;
+		WDF_TIMER_CONFIG_INIT(&timerConfig, CrosKBLightPersistTimerFunc);
+
+		WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+		attributes.ParentObject = device;
+		attributes.ExecutionLevel = WdfExecutionLevelPassive;
+
+		status = WdfTimerCreate(&timerConfig, &attributes, &devContext->persistTimer);
+		if (!NT_SUCCESS(status))
+		{
+			CrosKBLightPrint(DEBUG_LEVEL_ERROR, DBG_PNP,
+				"WdfTimerCreate failed 0x%x\n", status);
+
+			return status;
+		}
+	}
+
+	//
+	// Create the work item that probes for the backlight off the start path
+	//
+
+	{
+		WDF_WORKITEM_CONFIG workItemConfig;
+		WDF_WORKITEM_CONFIG_INIT(&workItemConfig, CrosKBLightProbeWorkItem);
+
+		WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+		attributes.ParentObject = device;
+
+		status = WdfWorkItemCreate(&workItemConfig, &attributes, &devContext->probeWorkItem);
+		if (!NT_SUCCESS(status))
+		{
+			CrosKBLightPrint(DEBUG_LEVEL_ERROR, DBG_PNP,
+				"WdfWorkItemCreate failed 0x%x\n", status);
+
+			return status;
+		}
+	}
+
+	//
+	// Create the timer and lock used to debounce S0ix notifications
+	//
+
+	status = WdfSpinLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &devContext->s0ixLock);
+	if (!NT_SUCCESS(status))
+	{
+		CrosKBLightPrint(DEBUG_LEVEL_ERROR, DBG_PNP,
+			"WdfSpinLockCreate failed 0x%x\n", status);
+
+		return status;
+	}
+
+	{
+		WDF_TIMER_CONFIG timerConfig;
+		WDF_TIMER_CONFIG_INIT(&timerConfig, CrosKBLightS0ixTimerFunc);
+
+		WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+		attributes.ParentObject = device;
+		attributes.ExecutionLevel = WdfExecutionLevelPassive;
+
+		status = WdfTimerCreate(&timerConfig, &attributes, &devContext->s0ixTimer);
+		if (!NT_SUCCESS(status))
+		{
+			CrosKBLightPrint(DEBUG_LEVEL_ERROR, DBG_PNP,
+				"WdfTimerCreate failed 0x%x\n", status);
+
+			return status;
+		}
+	}
+
 	return status;
 }
 
@@ -600,6 +1835,8 @@ CrosKBLightEvtInternalDeviceControl(
 	device = WdfIoQueueGetDevice(Queue);
 	devContext = GetDeviceContext(device);
 
+	GetRequestContext(Request)->ArrivalTime = KeQueryPerformanceCounter(NULL);
+
 	CrosKBLightPrint(DEBUG_LEVEL_INFO, DBG_IOCTL,
 		"%s, Queue:0x%p, Request:0x%p\n",
 		DbgHidInternalIoctlString(IoControlCode),
@@ -661,8 +1898,18 @@ CrosKBLightEvtInternalDeviceControl(
 	case IOCTL_HID_SET_OUTPUT_REPORT:
 		//
 		//Transmits a class driver-supplied report to the device.
+		//This may talk to the EC, so hand it to the EC queue.
 		//
-		status = CrosKBLightWriteReport(devContext, Request);
+		status = WdfRequestForwardToIoQueue(Request, devContext->EcQueue);
+		if (NT_SUCCESS(status))
+		{
+			completeRequest = FALSE;
+		}
+		else
+		{
+			CrosKBLightPrint(DEBUG_LEVEL_ERROR, DBG_IOCTL,
+				"WdfRequestForwardToIoQueue failed Status 0x%x\n", status);
+		}
 		break;
 
 	case IOCTL_HID_READ_REPORT:
@@ -704,6 +1951,9 @@ CrosKBLightEvtInternalDeviceControl(
 
 	if (completeRequest)
 	{
+		CrosKBLightRecordLatency(&devContext->defaultQueueStats,
+			GetRequestContext(Request)->ArrivalTime, status);
+
 		WdfRequestComplete(Request, status);
 
 		CrosKBLightPrint(DEBUG_LEVEL_INFO, DBG_IOCTL,
@@ -726,6 +1976,48 @@ CrosKBLightEvtInternalDeviceControl(
 	return;
 }
 
+VOID
+CrosKBLightEvtEcInternalDeviceControl(
+	IN WDFQUEUE     Queue,
+	IN WDFREQUEST   Request,
+	IN size_t       OutputBufferLength,
+	IN size_t       InputBufferLength,
+	IN ULONG        IoControlCode
+	)
+{
+	NTSTATUS            status = STATUS_SUCCESS;
+	PCROSKBLIGHT_CONTEXT     devContext;
+
+	UNREFERENCED_PARAMETER(OutputBufferLength);
+	UNREFERENCED_PARAMETER(InputBufferLength);
+
+	devContext = GetDeviceContext(WdfIoQueueGetDevice(Queue));
+
+	switch (IoControlCode)
+	{
+	case IOCTL_HID_WRITE_REPORT:
+	case IOCTL_HID_SET_OUTPUT_REPORT:
+		status = CrosKBLightWriteReport(devContext, Request);
+		break;
+
+	default:
+		status = STATUS_NOT_SUPPORTED;
+		break;
+	}
+
+	CrosKBLightRecordLatency(&devContext->ecQueueStats,
+		GetRequestContext(Request)->ArrivalTime, status);
+
+	WdfRequestComplete(Request, status);
+
+	CrosKBLightPrint(DEBUG_LEVEL_INFO, DBG_IOCTL,
+		"%s completed, Queue:0x%p, Request:0x%p\n",
+		DbgHidInternalIoctlString(IoControlCode),
+		Queue,
+		Request
+		);
+}
+
 NTSTATUS
 CrosKBLightGetHidDescriptor(
 	IN WDFDEVICE Device,
@@ -1048,13 +2340,47 @@ CrosKBLightWriteReport(
 				int val = pReport->Brightness;
 
 				if (reg == 0) {
-					int brightness = DevContext->currentBrightness;
+					int brightness = CrosKBLightReadState(DevContext).Brightness;
 					update_brightness(DevContext, brightness);
 				}
 				else if (reg == 1) {
-					DevContext->currentBrightness = val;
-					if (DevContext->ledExists) {
-						set_kbbl(DevContext, DevContext->currentBrightness);
+					BOOLEAN admitted = rate_admit(DevContext, Request);
+
+					//
+					// Strict mode fails an over-rate write outright. Otherwise
+					// it is published as usual and rateTimer sends the latest
+					// value once the window passes, so a burst costs one EC
+					// transaction.
+					//
+
+					if (!admitted && DevContext->rateStrict) {
+						InterlockedIncrement(&DevContext->rateRejected);
+						status = STATUS_DEVICE_BUSY;
+						break;
+					}
+
+					CrosKBLightPublishBrightness(DevContext, (UINT8)val);
+					persist_brightness(DevContext);
+
+					if (!admitted) {
+						InterlockedIncrement(&DevContext->rateCoalesced);
+						if (!InterlockedExchange(&DevContext->ratePending, 1)) {
+							WdfTimerStart(DevContext->rateTimer,
+								WDF_REL_TIMEOUT_IN_MS(1000 / DevContext->rateGlobalLimit + 1));
+						}
+						break;
+					}
+
+					//
+					// While a LampArray client is in control the new setting
+					// is only applied once it hands control back.
+					//
+
+					if (DevContext->ledExists && DevContext->lampAutonomous) {
+						if (NT_SUCCESS(set_kbbl_posted(DevContext, (UINT8)val, 0, Request))) {
+							WdfTimerStart(DevContext->verifyTimer,
+								WDF_REL_TIMEOUT_IN_MS(KBBL_VERIFY_IDLE_MS));
+						}
 					}
 				}
 				break;
@@ -1241,6 +2567,75 @@ CrosKBLightSetFeature(
 
 			switch (transferPacket->reportId)
 			{
+			case REPORTID_LAMP_ATTRIBUTES_REQUEST:
+				//
+				// There is only lamp 0, so the response doesn't depend on the
+				// requested id.
+				//
+
+				if (transferPacket->reportBufferLen < sizeof(CrosKBLightLampAttributesRequestReport)) {
+					status = STATUS_BUFFER_TOO_SMALL;
+				}
+				break;
+			case REPORTID_LAMP_MULTI_UPDATE: {
+				CrosKBLightLampMultiUpdateReport* pUpdate = (CrosKBLightLampMultiUpdateReport*)transferPacket->reportBuffer;
+
+				if (transferPacket->reportBufferLen < sizeof(*pUpdate)) {
+					status = STATUS_BUFFER_TOO_SMALL;
+					break;
+				}
+
+				if (pUpdate->LampCount > 1 || (pUpdate->LampCount == 1 && pUpdate->LampId != 0)) {
+					status = STATUS_INVALID_PARAMETER;
+					break;
+				}
+
+				if (pUpdate->LampCount == 1) {
+					lamp_update(DevContext, &pUpdate->Color, pUpdate->LampUpdateFlags);
+				}
+				break;
+			}
+			case REPORTID_LAMP_RANGE_UPDATE: {
+				CrosKBLightLampRangeUpdateReport* pUpdate = (CrosKBLightLampRangeUpdateReport*)transferPacket->reportBuffer;
+
+				if (transferPacket->reportBufferLen < sizeof(*pUpdate)) {
+					status = STATUS_BUFFER_TOO_SMALL;
+					break;
+				}
+
+				if (pUpdate->LampIdStart > pUpdate->LampIdEnd || pUpdate->LampIdStart != 0) {
+					status = STATUS_INVALID_PARAMETER;
+					break;
+				}
+
+				lamp_update(DevContext, &pUpdate->Color, pUpdate->LampUpdateFlags);
+				break;
+			}
+			case REPORTID_LAMPARRAY_CONTROL: {
+				CrosKBLightLampArrayControlReport* pControl = (CrosKBLightLampArrayControlReport*)transferPacket->reportBuffer;
+
+				if (transferPacket->reportBufferLen < sizeof(*pControl)) {
+					status = STATUS_BUFFER_TOO_SMALL;
+					break;
+				}
+
+				//
+				// Taking control keeps the current brightness as the target
+				// until the first frame; handing it back restores the vendor
+				// setting.
+				//
+
+				if (!pControl->AutonomousMode) {
+					InterlockedExchange(&DevContext->lampTarget,
+						CrosKBLightReadState(DevContext).Brightness);
+				}
+				DevContext->lampAutonomous = pControl->AutonomousMode != 0;
+				DevContext->lampWritten = -1;
+				if (DevContext->lampAutonomous) {
+					lamp_schedule(DevContext);
+				}
+				break;
+			}
 			default:
 
 				CrosKBLightPrint(DEBUG_LEVEL_ERROR, DBG_IOCTL,
@@ -1303,6 +2698,46 @@ CrosKBLightGetFeature(
 
 			switch (transferPacket->reportId)
 			{
+			case REPORTID_LAMPARRAY_ATTRIBUTES: {
+				CrosKBLightLampArrayAttributesReport* pAttributes = (CrosKBLightLampArrayAttributesReport*)transferPacket->reportBuffer;
+
+				if (transferPacket->reportBufferLen < sizeof(*pAttributes)) {
+					status = STATUS_BUFFER_TOO_SMALL;
+					break;
+				}
+
+				pAttributes->LampCount = 1;
+				pAttributes->BoundingBoxWidthInMicrometers = LAMPARRAY_WIDTH_UM;
+				pAttributes->BoundingBoxHeightInMicrometers = LAMPARRAY_HEIGHT_UM;
+				pAttributes->BoundingBoxDepthInMicrometers = LAMPARRAY_DEPTH_UM;
+				pAttributes->LampArrayKind = LAMPARRAY_KIND_KEYBOARD;
+				pAttributes->MinUpdateIntervalInMicroseconds = LAMPARRAY_COALESCE_MS * 1000;
+				WdfRequestSetInformation(Request, sizeof(*pAttributes));
+				break;
+			}
+			case REPORTID_LAMP_ATTRIBUTES_RESPONSE: {
+				CrosKBLightLampAttributesResponseReport* pAttributes = (CrosKBLightLampAttributesResponseReport*)transferPacket->reportBuffer;
+
+				if (transferPacket->reportBufferLen < sizeof(*pAttributes)) {
+					status = STATUS_BUFFER_TOO_SMALL;
+					break;
+				}
+
+				pAttributes->LampId = 0;
+				pAttributes->PositionXInMicrometers = LAMPARRAY_WIDTH_UM / 2;
+				pAttributes->PositionYInMicrometers = LAMPARRAY_HEIGHT_UM / 2;
+				pAttributes->PositionZInMicrometers = 0;
+				pAttributes->LampPurposes = LAMP_PURPOSE_ILLUMINATION;
+				pAttributes->UpdateLatencyInMicroseconds = LAMPARRAY_COALESCE_MS * 1000;
+				pAttributes->RedLevelCount = 0xFF;
+				pAttributes->GreenLevelCount = 0xFF;
+				pAttributes->BlueLevelCount = 0xFF;
+				pAttributes->IntensityLevelCount = 1;
+				pAttributes->IsProgrammable = 1;
+				pAttributes->InputBinding = 0;
+				WdfRequestSetInformation(Request, sizeof(*pAttributes));
+				break;
+			}
 			default:
 
 				CrosKBLightPrint(DEBUG_LEVEL_ERROR, DBG_IOCTL,
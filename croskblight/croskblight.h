@@ -69,6 +69,122 @@ HID_REPORT_DESCRIPTOR DefaultReportDescriptor[] = {
 	0x09, 0x02,                          //   USAGE (Vendor Usage 1)
 	0x81, 0x02,                          //   INPUT (Data,Var,Abs)
 	0xc0,                                // END_COLLECTION
+
+	0x05, 0x59,                          // USAGE_PAGE (Lighting And Illumination)
+	0x09, 0x01,                          // USAGE (LampArray)
+	0xa1, 0x01,                          // COLLECTION (Application)
+	0x85, REPORTID_LAMPARRAY_ATTRIBUTES, //   REPORT_ID (LampArray Attributes)
+	0x09, 0x02,                          //   USAGE (LampArrayAttributesReport)
+	0xa1, 0x02,                          //   COLLECTION (Logical)
+	0x09, 0x03,                          //     USAGE (LampCount)
+	0x15, 0x00,                          //     LOGICAL_MINIMUM (0)
+	0x27, 0xff, 0xff, 0x00, 0x00,        //     LOGICAL_MAXIMUM (65535)
+	0x75, 0x10,                          //     REPORT_SIZE (16)
+	0x95, 0x01,                          //     REPORT_COUNT (1)
+	0xb1, 0x03,                          //     FEATURE (Cnst,Var,Abs)
+	0x09, 0x04,                          //     USAGE (BoundingBoxWidthInMicrometers)
+	0x09, 0x05,                          //     USAGE (BoundingBoxHeightInMicrometers)
+	0x09, 0x06,                          //     USAGE (BoundingBoxDepthInMicrometers)
+	0x09, 0x07,                          //     USAGE (LampArrayKind)
+	0x09, 0x08,                          //     USAGE (MinUpdateIntervalInMicroseconds)
+	0x27, 0xff, 0xff, 0xff, 0x7f,        //     LOGICAL_MAXIMUM (2147483647)
+	0x75, 0x20,                          //     REPORT_SIZE (32)
+	0x95, 0x05,                          //     REPORT_COUNT (5)
+	0xb1, 0x03,                          //     FEATURE (Cnst,Var,Abs)
+	0xc0,                                //   END_COLLECTION
+	0x85, REPORTID_LAMP_ATTRIBUTES_REQUEST, // REPORT_ID (Lamp Attributes Request)
+	0x09, 0x20,                          //   USAGE (LampAttributesRequestReport)
+	0xa1, 0x02,                          //   COLLECTION (Logical)
+	0x09, 0x21,                          //     USAGE (LampId)
+	0x27, 0xff, 0xff, 0x00, 0x00,        //     LOGICAL_MAXIMUM (65535)
+	0x75, 0x10,                          //     REPORT_SIZE (16)
+	0x95, 0x01,                          //     REPORT_COUNT (1)
+	0xb1, 0x02,                          //     FEATURE (Data,Var,Abs)
+	0xc0,                                //   END_COLLECTION
+	0x85, REPORTID_LAMP_ATTRIBUTES_RESPONSE, // REPORT_ID (Lamp Attributes Response)
+	0x09, 0x22,                          //   USAGE (LampAttributesResponseReport)
+	0xa1, 0x02,                          //   COLLECTION (Logical)
+	0x09, 0x21,                          //     USAGE (LampId)
+	0x27, 0xff, 0xff, 0x00, 0x00,        //     LOGICAL_MAXIMUM (65535)
+	0x75, 0x10,                          //     REPORT_SIZE (16)
+	0x95, 0x01,                          //     REPORT_COUNT (1)
+	0xb1, 0x02,                          //     FEATURE (Data,Var,Abs)
+	0x09, 0x23,                          //     USAGE (PositionXInMicrometers)
+	0x09, 0x24,                          //     USAGE (PositionYInMicrometers)
+	0x09, 0x25,                          //     USAGE (PositionZInMicrometers)
+	0x09, 0x26,                          //     USAGE (LampPurposes)
+	0x09, 0x27,                          //     USAGE (UpdateLatencyInMicroseconds)
+	0x27, 0xff, 0xff, 0xff, 0x7f,        //     LOGICAL_MAXIMUM (2147483647)
+	0x75, 0x20,                          //     REPORT_SIZE (32)
+	0x95, 0x05,                          //     REPORT_COUNT (5)
+	0xb1, 0x02,                          //     FEATURE (Data,Var,Abs)
+	0x09, 0x28,                          //     USAGE (RedLevelCount)
+	0x09, 0x29,                          //     USAGE (GreenLevelCount)
+	0x09, 0x2a,                          //     USAGE (BlueLevelCount)
+	0x09, 0x2b,                          //     USAGE (IntensityLevelCount)
+	0x09, 0x2c,                          //     USAGE (IsProgrammable)
+	0x09, 0x2d,                          //     USAGE (InputBinding)
+	0x26, 0xff, 0x00,                    //     LOGICAL_MAXIMUM (255)
+	0x75, 0x08,                          //     REPORT_SIZE (8)
+	0x95, 0x06,                          //     REPORT_COUNT (6)
+	0xb1, 0x02,                          //     FEATURE (Data,Var,Abs)
+	0xc0,                                //   END_COLLECTION
+	0x85, REPORTID_LAMP_MULTI_UPDATE,    //   REPORT_ID (Lamp Multi Update)
+	0x09, 0x50,                          //   USAGE (LampMultiUpdateReport)
+	0xa1, 0x02,                          //   COLLECTION (Logical)
+	0x09, 0x03,                          //     USAGE (LampCount)
+	0x09, 0x55,                          //     USAGE (LampUpdateFlags)
+	0x25, 0x01,                          //     LOGICAL_MAXIMUM (1)
+	0x75, 0x08,                          //     REPORT_SIZE (8)
+	0x95, 0x02,                          //     REPORT_COUNT (2)
+	0xb1, 0x02,                          //     FEATURE (Data,Var,Abs)
+	0x09, 0x21,                          //     USAGE (LampId)
+	0x27, 0xff, 0xff, 0x00, 0x00,        //     LOGICAL_MAXIMUM (65535)
+	0x75, 0x10,                          //     REPORT_SIZE (16)
+	0x95, 0x01,                          //     REPORT_COUNT (1)
+	0xb1, 0x02,                          //     FEATURE (Data,Var,Abs)
+	0x09, 0x51,                          //     USAGE (RedUpdateChannel)
+	0x09, 0x52,                          //     USAGE (GreenUpdateChannel)
+	0x09, 0x53,                          //     USAGE (BlueUpdateChannel)
+	0x09, 0x54,                          //     USAGE (IntensityUpdateChannel)
+	0x26, 0xff, 0x00,                    //     LOGICAL_MAXIMUM (255)
+	0x75, 0x08,                          //     REPORT_SIZE (8)
+	0x95, 0x04,                          //     REPORT_COUNT (4)
+	0xb1, 0x02,                          //     FEATURE (Data,Var,Abs)
+	0xc0,                                //   END_COLLECTION
+	0x85, REPORTID_LAMP_RANGE_UPDATE,    //   REPORT_ID (Lamp Range Update)
+	0x09, 0x60,                          //   USAGE (LampRangeUpdateReport)
+	0xa1, 0x02,                          //   COLLECTION (Logical)
+	0x09, 0x55,                          //     USAGE (LampUpdateFlags)
+	0x25, 0x01,                          //     LOGICAL_MAXIMUM (1)
+	0x75, 0x08,                          //     REPORT_SIZE (8)
+	0x95, 0x01,                          //     REPORT_COUNT (1)
+	0xb1, 0x02,                          //     FEATURE (Data,Var,Abs)
+	0x09, 0x61,                          //     USAGE (LampIdStart)
+	0x09, 0x62,                          //     USAGE (LampIdEnd)
+	0x27, 0xff, 0xff, 0x00, 0x00,        //     LOGICAL_MAXIMUM (65535)
+	0x75, 0x10,                          //     REPORT_SIZE (16)
+	0x95, 0x02,                          //     REPORT_COUNT (2)
+	0xb1, 0x02,                          //     FEATURE (Data,Var,Abs)
+	0x09, 0x51,                          //     USAGE (RedUpdateChannel)
+	0x09, 0x52,                          //     USAGE (GreenUpdateChannel)
+	0x09, 0x53,                          //     USAGE (BlueUpdateChannel)
+	0x09, 0x54,                          //     USAGE (IntensityUpdateChannel)
+	0x26, 0xff, 0x00,                    //     LOGICAL_MAXIMUM (255)
+	0x75, 0x08,                          //     REPORT_SIZE (8)
+	0x95, 0x04,                          //     REPORT_COUNT (4)
+	0xb1, 0x02,                          //     FEATURE (Data,Var,Abs)
+	0xc0,                                //   END_COLLECTION
+	0x85, REPORTID_LAMPARRAY_CONTROL,    //   REPORT_ID (LampArray Control)
+	0x09, 0x70,                          //   USAGE (LampArrayControlReport)
+	0xa1, 0x02,                          //   COLLECTION (Logical)
+	0x09, 0x71,                          //     USAGE (AutonomousMode)
+	0x25, 0x01,                          //     LOGICAL_MAXIMUM (1)
+	0x75, 0x08,                          //     REPORT_SIZE (8)
+	0x95, 0x01,                          //     REPORT_COUNT (1)
+	0xb1, 0x02,                          //     FEATURE (Data,Var,Abs)
+	0xc0,                                //   END_COLLECTION
+	0xc0,                                // END_COLLECTION
 };
 
 
@@ -97,25 +213,153 @@ typedef struct _EC_PORT {
 	ULONG Length;
 } ECPort, *PECPort;
 
+//
+// Brightness and EC state, published as a single 64-bit word so readers
+// never need ecLock and never see a torn update.
+//
+
+typedef union _CROSKBLIGHT_STATE {
+	struct {
+		UINT8 Brightness;
+		UINT8 Mode;
+		UINT16 Generation;
+		NTSTATUS LastError;
+	};
+	LONG64 Value;
+} CROSKBLIGHT_STATE, *PCROSKBLIGHT_STATE;
+
+C_ASSERT(sizeof(CROSKBLIGHT_STATE) == sizeof(LONG64));
+
+typedef struct _CROSKBLIGHT_LATENCY_STATS {
+	volatile LONG Count;
+	volatile LONG Failures;
+	volatile LONG64 LastUs;
+	volatile LONG64 MaxUs;
+	volatile LONG64 TotalUs;
+} CROSKBLIGHT_LATENCY_STATS, *PCROSKBLIGHT_LATENCY_STATS;
+
+//
+// Port operations issued by a mailbox transaction. AddressWrites counts the
+// EMI address/access mode writes, which are also included in Writes.
+// StatusPolls counts the command port reads made while waiting on the EC,
+// which are also included in Reads and depend on EC timing.
+//
+
+typedef struct _CROSKBLIGHT_PORT_STATS {
+	ULONG64 Reads;
+	ULONG64 Writes;
+	ULONG64 AddressWrites;
+	ULONG64 StatusPolls;
+} CROSKBLIGHT_PORT_STATS, *PCROSKBLIGHT_PORT_STATS;
+
+//
+// Token bucket for EC-bound requests. Tokens are kept in thousandths so slow
+// rates still refill smoothly; LastRefill is in interrupt time (100ns).
+// ClientId is the requesting process, 0 for the global bucket.
+//
+
+#define CROSKBLIGHT_RATE_CLIENTS 8
+
+typedef struct _CROSKBLIGHT_TOKEN_BUCKET {
+	ULONG_PTR ClientId;
+	ULONG64 Tokens;
+	ULONG64 LastRefill;
+} CROSKBLIGHT_TOKEN_BUCKET, *PCROSKBLIGHT_TOKEN_BUCKET;
+
 typedef struct _CROSKBLIGHT_CONTEXT
 {
 	WDFDEVICE FxDevice;
 
 	WDFQUEUE ReportQueue;
 
-	UINT8 currentBrightness;
+	volatile LONG droppedReports;
+
+	WDFQUEUE EcQueue;
+
+	CROSKBLIGHT_LATENCY_STATS defaultQueueStats;
+	CROSKBLIGHT_LATENCY_STATS ecQueueStats;
+
+	DECLSPEC_ALIGN(8) volatile LONG64 State;
+
+	BOOLEAN brightnessRestored;
+	UINT16 persistedGeneration;
+	UINT8 persistedBrightness;
+
+	WDFTIMER persistTimer;
+	LONG persistPending;
 
 	//S0IX Notify
 	ACPI_INTERFACE_STANDARD2 S0ixNotifyAcpiInterface;
+	BOOLEAN s0ixRegistered;
+
+	WDFSPINLOCK s0ixLock;
+	WDFTIMER s0ixTimer;
+	BOOLEAN s0ixPending;
+	BOOLEAN s0ixTarget;
+	BOOLEAN s0ixApplied;
+	ULONG s0ixNotifications;
+	ULONG s0ixCollapsed;
 
 	WDFWAITLOCK ecLock;
 
+	CROSKBLIGHT_LATENCY_STATS ecLockWaitStats;
+	CROSKBLIGHT_LATENCY_STATS ecLockHoldStats;
+
+	CROSKBLIGHT_PORT_STATS ecPortOps;
+	CROSKBLIGHT_PORT_STATS ecPortLast;
+	CROSKBLIGHT_PORT_STATS ecPortTotal;
+
+	BOOLEAN ecPosted;
+	volatile LONG ecStopping;
+
+	//Optional EC completion interrupt, see wilco_ec_isr
+	WDFINTERRUPT ecInterrupt;
+	KEVENT ecEvent;
+	volatile LONG ecWaiting;
+	volatile LONG ecInterrupts;
+
+	WDFTIMER verifyTimer;
+
+	//Set by OnD0Exit; deferred writes check it instead of being waited for
+	volatile LONG suspended;
+
+	//LampArray
+	WDFTIMER lampTimer;
+	LONG lampPending;
+	volatile LONG lampTarget;
+	LONG lampWritten;
+	BOOLEAN lampAutonomous;
+	volatile LONG lampUpdates;
+	volatile LONG lampWrites;
+
 	BOOLEAN ledExists;
 
+	WDFWORKITEM probeWorkItem;
+	LONG probePending;
+
+	CROSKBLIGHT_LATENCY_STATS prepareStats;
+	CROSKBLIGHT_LATENCY_STATS d0EntryStats;
+	CROSKBLIGHT_LATENCY_STATS d0ExitStats;
+	CROSKBLIGHT_LATENCY_STATS releaseStats;
+
+	//Rate limiting; the buckets are shared by EcQueue and rateTimer
+	ULONG rateLimit;
+	ULONG rateGlobalLimit;
+	ULONG rateBurst;
+	BOOLEAN rateStrict;
+	WDFSPINLOCK rateLock;
+	CROSKBLIGHT_TOKEN_BUCKET rateGlobal;
+	CROSKBLIGHT_TOKEN_BUCKET rateClients[CROSKBLIGHT_RATE_CLIENTS];
+	WDFTIMER rateTimer;
+	LONG ratePending;
+	volatile LONG rateCoalesced;
+	volatile LONG rateRejected;
+
 	ECPort ecIoData;
 	ECPort ecIoCommand;
 	ECPort ecIoPacket;
 	PVOID dataBuffer;
+	volatile LONG poolAllocations;
 
 	WDFIOTARGET busIoTarget;
 
@@ -123,6 +367,14 @@ typedef struct _CROSKBLIGHT_CONTEXT
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(CROSKBLIGHT_CONTEXT, GetDeviceContext)
 
+typedef struct _CROSKBLIGHT_REQUEST_CONTEXT
+{
+	LARGE_INTEGER ArrivalTime;
+
+} CROSKBLIGHT_REQUEST_CONTEXT, *PCROSKBLIGHT_REQUEST_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(CROSKBLIGHT_REQUEST_CONTEXT, GetRequestContext)
+
 //
 // Function definitions
 //
@@ -137,6 +389,18 @@ EVT_WDFDEVICE_WDM_IRP_PREPROCESS CrosKBLightEvtWdmPreprocessMnQueryId;
 
 EVT_WDF_IO_QUEUE_IO_INTERNAL_DEVICE_CONTROL CrosKBLightEvtInternalDeviceControl;
 
+EVT_WDF_IO_QUEUE_IO_INTERNAL_DEVICE_CONTROL CrosKBLightEvtEcInternalDeviceControl;
+
+#ifdef __cplusplus
+extern "C"
+#endif
+VOID
+CrosKBLightRecordLatency(
+	_Inout_ PCROSKBLIGHT_LATENCY_STATS Stats,
+	_In_ LARGE_INTEGER Start,
+	_In_ NTSTATUS Status
+	);
+
 NTSTATUS
 CrosKBLightGetHidDescriptor(
 	IN WDFDEVICE Device,
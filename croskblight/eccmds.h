@@ -5,10 +5,22 @@
 
 /* Message flags for using the mailbox() interface */
 #define WILCO_EC_FLAG_NO_RESPONSE	BIT(0) /* EC does not respond */
+#define WILCO_EC_FLAG_EXTENDED_DATA	BIT(1) /* EC returns 256 data bytes */
+#define WILCO_EC_FLAG_BOUNDED		BIT(2) /* Use the short suspend budget */
+#define WILCO_EC_FLAG_CHECKSUM_VALID	BIT(3) /* request_checksum is precomputed */
+
+/* Version of mailbox interface */
+#define EC_MAILBOX_VERSION		0
+
+/* Version of EC protocol */
+#define EC_MAILBOX_PROTO_VERSION	3
 
 /* Normal commands have a maximum 32 bytes of data */
 #define EC_MAILBOX_DATA_SIZE		32
 
+/* Extended commands (telemetry, event log) have 256 bytes of response data */
+#define EC_MAILBOX_DATA_SIZE_EXTENDED	256
+
 #include <pshpack1.h>
 
 /**
@@ -47,8 +59,36 @@ struct wilco_ec_response {
 	UINT8 data[];
 };
 
+/**
+ * struct ec_port_trace_record - One port access captured by the trace backend.
+ * @time_us: Microseconds since the driver first initialized the EC. 64 bits
+ *           so long traces don't wrap (32 bits would after about 71
+ *           minutes).
+ * @port: I/O port accessed, or 0 for %EC_TRACE_MAILBOX markers.
+ * @value: Value written or read back.
+ * @op: One of enum ec_port_trace_op.
+ */
+struct ec_port_trace_record {
+	UINT64 time_us;
+	UINT16 port;
+	UINT16 value;
+	UINT8 op;
+};
+
 #include <poppack.h>
 
+/**
+ * enum ec_port_trace_op - Kind of access in a struct ec_port_trace_record.
+ * @EC_TRACE_MAILBOX: Start of a wilco_ec_mailbox() transaction.
+ */
+enum ec_port_trace_op {
+	EC_TRACE_INB = 0,
+	EC_TRACE_INW = 1,
+	EC_TRACE_OUTB = 2,
+	EC_TRACE_OUTW = 3,
+	EC_TRACE_MAILBOX = 4,
+};
+
 /**
  * enum wilco_ec_msg_type - Message type to select a set of command codes.
  * @WILCO_EC_MSG_LEGACY: Legacy EC messages for standard EC behavior.
@@ -65,11 +105,16 @@ enum wilco_ec_msg_type {
  * struct wilco_ec_message - Request and response message.
  * @type: Mailbox message type.
  * @flags: Message flags, e.g. %WILCO_EC_FLAG_NO_RESPONSE.
+ *         Set %WILCO_EC_FLAG_EXTENDED_DATA for commands that return
+ *         %EC_MAILBOX_DATA_SIZE_EXTENDED bytes of data.
  * @request_size: Number of bytes to send to the EC.
  * @request_data: Buffer containing the request data.
  * @response_size: Number of bytes to read from EC.
  * @response_data: Buffer containing the response data, should be
  *                 response_size bytes and allocated by caller.
+ * @request_checksum: With %WILCO_EC_FLAG_CHECKSUM_VALID, the checksum of the
+ *                    request header and data, computed by the caller.
+ * @request: Optional, waits for the EC are abandoned if it is cancelled.
  */
 struct wilco_ec_message {
 	enum wilco_ec_msg_type type;
@@ -78,6 +123,8 @@ struct wilco_ec_message {
 	void* request_data;
 	size_t response_size;
 	void* response_data;
+	UINT8 request_checksum;
+	WDFREQUEST request;
 };
 
 #endif /* __CROS_EC_REGS_H__ */
\ No newline at end of file
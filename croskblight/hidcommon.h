@@ -16,6 +16,21 @@
 
 #define REPORTID_KBLIGHT       0x01
 
+#define REPORTID_LAMPARRAY_ATTRIBUTES     0x02
+#define REPORTID_LAMP_ATTRIBUTES_REQUEST  0x03
+#define REPORTID_LAMP_ATTRIBUTES_RESPONSE 0x04
+#define REPORTID_LAMP_MULTI_UPDATE        0x05
+#define REPORTID_LAMP_RANGE_UPDATE        0x06
+#define REPORTID_LAMPARRAY_CONTROL        0x07
+
+//
+// LampArray values (HID Usage Tables, Lighting And Illumination page)
+//
+
+#define LAMPARRAY_KIND_KEYBOARD           0x01
+#define LAMP_PURPOSE_ILLUMINATION         0x10
+#define LAMP_UPDATE_FLAG_COMPLETE         0x01
+
 #pragma pack(1)
 typedef struct _CROSKBLIGHT_FEATURE_REPORT
 {
@@ -62,5 +77,118 @@ typedef struct _CROSKBLIGHT_SETTINGS_REPORT
 } CrosKBLightSettingsReport;
 #pragma pack()
 
+#pragma pack(1)
+typedef struct _CROSKBLIGHT_LAMPARRAY_ATTRIBUTES_REPORT
+{
+
+	BYTE        ReportID;
+
+	USHORT      LampCount;
+
+	ULONG       BoundingBoxWidthInMicrometers;
+
+	ULONG       BoundingBoxHeightInMicrometers;
+
+	ULONG       BoundingBoxDepthInMicrometers;
+
+	ULONG       LampArrayKind;
+
+	ULONG       MinUpdateIntervalInMicroseconds;
+
+} CrosKBLightLampArrayAttributesReport;
+
+typedef struct _CROSKBLIGHT_LAMP_ATTRIBUTES_REQUEST_REPORT
+{
+
+	BYTE        ReportID;
+
+	USHORT      LampId;
+
+} CrosKBLightLampAttributesRequestReport;
+
+typedef struct _CROSKBLIGHT_LAMP_ATTRIBUTES_RESPONSE_REPORT
+{
+
+	BYTE        ReportID;
+
+	USHORT      LampId;
+
+	ULONG       PositionXInMicrometers;
+
+	ULONG       PositionYInMicrometers;
+
+	ULONG       PositionZInMicrometers;
+
+	ULONG       LampPurposes;
+
+	ULONG       UpdateLatencyInMicroseconds;
+
+	BYTE        RedLevelCount;
+
+	BYTE        GreenLevelCount;
+
+	BYTE        BlueLevelCount;
+
+	BYTE        IntensityLevelCount;
+
+	BYTE        IsProgrammable;
+
+	BYTE        InputBinding;
+
+} CrosKBLightLampAttributesResponseReport;
+
+typedef struct _CROSKBLIGHT_LAMP_COLOR
+{
+
+	BYTE        Red;
+
+	BYTE        Green;
+
+	BYTE        Blue;
+
+	BYTE        Intensity;
+
+} CrosKBLightLampColor;
+
+typedef struct _CROSKBLIGHT_LAMP_MULTI_UPDATE_REPORT
+{
+
+	BYTE        ReportID;
+
+	BYTE        LampCount;
+
+	BYTE        LampUpdateFlags;
+
+	USHORT      LampId;
+
+	CrosKBLightLampColor Color;
+
+} CrosKBLightLampMultiUpdateReport;
+
+typedef struct _CROSKBLIGHT_LAMP_RANGE_UPDATE_REPORT
+{
+
+	BYTE        ReportID;
+
+	BYTE        LampUpdateFlags;
+
+	USHORT      LampIdStart;
+
+	USHORT      LampIdEnd;
+
+	CrosKBLightLampColor Color;
+
+} CrosKBLightLampRangeUpdateReport;
+
+typedef struct _CROSKBLIGHT_LAMPARRAY_CONTROL_REPORT
+{
+
+	BYTE        ReportID;
+
+	BYTE        AutonomousMode;
+
+} CrosKBLightLampArrayControlReport;
+#pragma pack()
+
 #endif
 #pragma once